@@ -7,10 +7,14 @@
 #include <sys/types.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <mcheck.h>
 #include <math.h>
-#include <getopt.h>
 
 // The OpenSSL library is used for the hashing functions. It needs to be
 // installed separately:
@@ -27,19 +31,14 @@
 
 #include "cakelog.h"
 
-// A tree is made up of Nodes and a Node can be implemented as a basic struct.
-// The struct is made up of recursive 'left' and 'right' references to itself
-// for the branches (or 'NULL' if a leaf) and a char* for the data which, in
-// this case, will be a 64-character hash digest represented as a hexidecimal
-// string.
+// The Node, MerkleTree and other types used to build the tree, along with the
+// functions that can be called from outside this file, are declared in
+// merkle_tree.h. The mtree program (mtree.c) and the Python extension module
+// (merkle_tree_module.c) are both built on top of them.
 
-struct Node {
-    struct Node *left;
-    struct Node *right;
-    char *sha256_digest;
-}; 
+#include "merkle_tree.h"
 
-typedef struct Node Node;
+bool print_progress = false;
 
 // A basic C-style constructor reduces clutter when creating Nodes as the tree
 // is being built.
@@ -59,73 +58,85 @@ Node* new_node(Node *left, Node *right, char *sha256_digest) {
     return node;
 }
 
-// read_data_file() loads the data used to populate the tree into a memory
-// buffer. For this test program, the data is a file containing a series of
+// map_data_file() makes the data used to populate the tree available in
+// memory. For this test program, the data is a file containing a series of
 // words separated by an '\n' (newline) character. The folder test-data/ in this
 // repo contains an example, 5MB file of all words in the English dictionary.
 //
-// Linux system calls are used to open and read the contents of the file:
+// Linux system calls are used to open and map the contents of the file:
 //
 //      open(): https://man7.org/linux/man-pages/man2/open.2.html 
 //      fstat(): https://man7.org/linux/man-pages/man2/fstat.2.html
-//      read(): https://man7.org/linux/man-pages/man2/read.2.html
+//      mmap(): https://man7.org/linux/man-pages/man2/mmap.2.html
 //
-// Note that any failures to these calls results in the program aborting.
+// The file is mapped rather than read() into a malloc()'d buffer so that it
+// stays available, unmodified, for as long as the tree exists. When only part
+// of the tree is retained (see RetentionPolicy, below) the records under a
+// dropped subtree are hashed again straight from the mapping whenever a proof
+// or diff needs them, and the kernel is free to page the file in and out
+// rather than it all having to sit on the heap.
 //
-// A pointer to the data in memory is returned.
+// A pointer to the mapped data is returned and its length is written to
+// 'data_len'. If any of these calls fail then NULL is returned and 'errno' is
+// left for the caller to report. The file is used by long-running callers
+// (the Python module, for instance) as well as mtree, so it's up to them
+// whether a missing file is the end of the world.
 
-char* read_data_file(const char *dict_file) {
+char* map_data_file(const char *dict_file, long *data_len) {
 
-    cakelog("===== read_dictionary_file() =====");
+    cakelog("===== map_data_file() =====");
 
     const int dictionary_fd = open(dict_file, O_RDONLY);
     if (dictionary_fd == -1) {
-        perror("open()");
         cakelog("failed to open file: '%s'", dict_file);
-        exit(EXIT_FAILURE);
+        return NULL;
     }
 
     cakelog("opened file %s", dict_file);
     
-    // fstat() is used to get the size of the file in bytes. This value can then
-    // be passed to malloc() to request a block of memory large enough to store
-    // the whole file. The file size can also be used in the call to read() to
-    // load the entire file in at once.
+    // fstat() is used to get the size of the file in bytes, which is how much
+    // of it needs to be mapped.
 
     struct stat dict_stats;
     
     if (fstat(dictionary_fd, &dict_stats) == -1) {
         cakelog("failed to get statistics for dictionary file");
-        perror("fstat()");
-        exit(EXIT_FAILURE);
+        close(dictionary_fd);
+        return NULL;
     }
 
     const long file_size = dict_stats.st_size;
 
     cakelog("file_size is %ld bytes", file_size);
 
-    // Increment the buffer size by 1 to make room for the NULL terminator which
-    // will be added once all the data has been loaded.
+    // mmap() refuses to map zero bytes and, in any case, there's nothing to
+    // build a tree from.
 
-    const long buffer_size = file_size + 1;
-    char* buffer = malloc(buffer_size);
-     
-    // Now read the whole file into memory with one call to read().
+    if (file_size == 0) {
+        cakelog("file is empty");
+        close(dictionary_fd);
+        errno = ENODATA;
+        return NULL;
+    }
 
-    ssize_t bytes_read;
-    if((bytes_read = read(dictionary_fd, buffer, file_size)) != file_size) {
-        cakelog("unable to load file");
-        perror("read()");
-        exit(EXIT_FAILURE);
+    // Now map the whole file with one call to mmap(). The mapping is read-only
+    // and private so the file on disk can never be changed through it.
+
+    char *buffer = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, dictionary_fd, 0);
+    if (buffer == MAP_FAILED) {
+        cakelog("unable to map file");
+        close(dictionary_fd);
+        return NULL;
     }
 
-    cakelog("loaded %ld bytes into buffer", bytes_read);
+    cakelog("mapped %ld bytes at address %p", file_size, buffer);
 
-    close(dictionary_fd);
+    // The mapping holds its own reference to the file so the descriptor can
+    // be closed straight away.
 
-    // Add on the NULL terminator ('\0')
+    close(dictionary_fd);
 
-    buffer[file_size] = '\0';
+    *data_len = file_size;
 
     return buffer;
     
@@ -145,11 +156,14 @@ char* read_data_file(const char *dict_file) {
 // When compiling, the '-lssl' and '-lcrypto' switches must also be used to link
 // the OpenSSL libraries.
 
-unsigned char* sha256(const char *data) {
+// The data is no longer NULL terminated when it comes straight from the mapped
+// file (see map_data_file()) so the length of 'data' is passed in 'data_len'.
+
+unsigned char* sha256(const char *data, size_t data_len) {
 
     cakelog("===== sha256() =====");
 
-    unsigned int data_len = strlen(data);
+    unsigned int digest_len;
 
     // Declare an EnVeloPe Message Digest Context pointer called 'mdctx'.
 
@@ -178,7 +192,7 @@ unsigned char* sha256(const char *data) {
     // reached. Here, however, the function is only called once because all the
     // data is available in the 'data' parameter.
 
-    cakelog("updating mdctx digest with data [%s]", data);
+    cakelog("updating mdctx digest with data [%.*s]", (int)data_len, data);
     EVP_DigestUpdate(mdctx, data, data_len);
     
     // Next to allocate space for the digest itself.
@@ -196,7 +210,7 @@ unsigned char* sha256(const char *data) {
     // Now copy the generated hash into the 'hash_digest' char* declared and
     // initialised above.
 
-    EVP_DigestFinal_ex(mdctx, hash_digest, &data_len);
+    EVP_DigestFinal_ex(mdctx, hash_digest, &digest_len);
     cakelog("succesfully copied new digest to hash_digest buffer");
     
     // Use the free function provided by the EVP interface to free up the
@@ -251,26 +265,152 @@ char* hexdigest(const unsigned char *hash) {
     
 }
 
-// A simple function to count all the words in the data buffer. It scans the
-// buffer one character at a time and increments a counter each time it finds a
-// newline ('\n') character. This function is used in build_leaves() to
-// calculate how much memory should be allocated for the list of leaves.
+// digest_to_hex() does the same job as hexdigest() but writes the 64 hex
+// characters and a NULL terminator to 'hex_digest', which must have room for
+// 65 characters, instead of allocating a new string. digest_from_hex() goes
+// the other way and returns false if 'hex_digest' isn't 64 hex characters.
 
-long get_word_count(const char* data) {
+void digest_to_hex(const unsigned char *hash, char *hex_digest) {
 
-    cakelog("===== get_word_count() =====");
+    static const char hex_chars[] = "0123456789abcdef";
 
-    long word_count = 0;
-    for (int i=0; data[i] != '\0'; i++) {
-         if (data[i] == '\n') {
-             word_count++;
-         }
-     }
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        hex_digest[i * 2] = hex_chars[hash[i] >> 4];
+        hex_digest[(i * 2) + 1] = hex_chars[hash[i] & 0x0f];
+    }
+
+    hex_digest[64] = '\0';
+}
+
+int hex_value(char c) {
+
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+bool digest_from_hex(const char *hex_digest, unsigned char *hash) {
+
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+
+        const int high = hex_value(hex_digest[i * 2]);
+        const int low = hex_value(hex_digest[(i * 2) + 1]);
+
+        if (high == -1 || low == -1) {
+            return false;
+        }
+
+        hash[i] = (high << 4) | low;
+    }
+
+    return true;
+}
+
+// sha256_hex() is a shortcut for hexdigest(sha256(...)) used wherever digests
+// are recomputed on demand (see compute_subtree(), below). Nodes keep the
+// strings hexdigest() allocates for them, but a recomputed digest is only
+// needed until the caller has compared or concatenated it, so it is written
+// straight into a 65-byte buffer supplied by the caller.
+//
+// Rebuilding a subtree can mean millions of calls, so rather than allocating
+// and freeing a context every time, as sha256() does, each thread keeps one
+// context and re-initialises it. Passing NULL as the digest type to
+// EVP_DigestInit_ex() reuses the SHA256 implementation the context already
+// has, which saves OpenSSL looking it up again on every call. The context is
+// also registered under a pthread key so it's freed when its thread exits
+// (the Python module hashes from whichever threads call it, and they come
+// and go).
+
+static pthread_key_t mdctx_key;
+static pthread_once_t mdctx_key_once = PTHREAD_ONCE_INIT;
+
+static void free_mdctx(void *mdctx) {
+    EVP_MD_CTX_free(mdctx);
+}
+
+static void create_mdctx_key(void) {
+    pthread_key_create(&mdctx_key, free_mdctx);
+}
+
+void sha256_hex(const char *data, size_t data_len, char *hex_digest) {
+
+    static __thread EVP_MD_CTX *mdctx = NULL;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+
+    if (mdctx == NULL) {
+        mdctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL);
+        pthread_once(&mdctx_key_once, create_mdctx_key);
+        pthread_setspecific(mdctx_key, mdctx);
+    }
+    else {
+        EVP_DigestInit_ex(mdctx, NULL, NULL);
+    }
+
+    EVP_DigestUpdate(mdctx, data, data_len);
+    EVP_DigestFinal_ex(mdctx, hash, NULL);
+
+    digest_to_hex(hash, hex_digest);
+
+}
+
+// next_record() points 'record' at the next record in the data and writes its
+// length to 'record_len'. It returns false once the data is exhausted.
+
+bool next_record(RecordCursor *cursor, const char **record, long *record_len) {
+
+    while (cursor->pos < cursor->data_len && cursor->data[cursor->pos] == '\n') {
+        cursor->pos++;
+    }
+
+    if (cursor->pos >= cursor->data_len) {
+        return false;
+    }
+
+    const long start = cursor->pos;
+
+    while (cursor->pos < cursor->data_len && cursor->data[cursor->pos] != '\n') {
+        cursor->pos++;
+    }
+
+    *record = cursor->data + start;
+    *record_len = cursor->pos - start;
+
+    return true;
+}
+
+// A simple function to count all the words in the data buffer. It walks the
+// buffer with next_record() and increments a counter for each record it finds.
+// This function is used to work out how many leaves the tree will have, and so
+// how many layers it will have and how much memory each one needs, before any
+// hashing is done.
+//
+// Counting with next_record() rather than counting newline ('\n') characters
+// means a trailing newline or a blank line can't make the count disagree with
+// the number of leaves actually built.
+
+long get_word_count(const char* data, long data_len) {
+
+    cakelog("===== get_word_count() =====");
 
-    // Need to increment the counter one last time because the last word in the
-    // buffer is followed by '\0' (NULL terminator), not '\n'.
+    RecordCursor cursor = { data, data_len, 0 };
+    const char *record;
+    long record_len;
 
-     word_count++;
+    long word_count = 0;
+    while (next_record(&cursor, &record, &record_len)) {
+        word_count++;
+    }
 
      cakelog("returning word count of %ld", word_count);
      
@@ -278,44 +418,35 @@ long get_word_count(const char* data) {
 }
 
 // To start building the tree a list of Nodes is required to act as the bottom
-// layer, or leaves. This function scans the buffer of words read in during
-// 'read_data_file()' and adds them (or, rather, pointers to them) to new Node
-// objects. The leaves are returned as a chain of Node pointers ready to be
-// turned into a tree.
+// layer, or leaves. This function scans the data mapped in during
+// 'map_data_file()' and hashes each word into a new Node object. The leaves
+// are returned as a chain of Node pointers ready to be turned into a tree.
 
-Node** build_leaves(char* buffer) {
+Node** build_leaves(const char* data, long data_len, long word_count) {
 
     cakelog("===== build_leaves() =====");
   
-    // Because the list of words in the test data is of fixed length and, thanks
-    // to the way they're separated, easy to count, enough memory to store all
-    // the Node pointers in the leaves can be pre-allocated with one call to
-    // malloc(). get_word_count() can be used to establish how may words there are
-    // in the data which will reveal how many Nodes are needed and, therefore,
-    // how much memory to allocate.
-
-    long word_count = get_word_count(buffer);
+    // get_word_count() has already established how may words there are in the
+    // data which reveals how many Nodes are needed and, therefore, how much
+    // memory to allocate, so all the Node pointers in the leaves can be
+    // pre-allocated with one call to malloc().
+
     Node **leaves = malloc(sizeof(Node*)*word_count);
 
-    cakelog("allocated %ld bytes for %ld leaves (number of leaves * sizeof(pointer) + NULL terminator", word_count * sizeof(unsigned char*) + 1, word_count);
+    cakelog("allocated %ld bytes for %ld leaves (number of leaves * sizeof(pointer))", word_count * sizeof(Node*), word_count);
 
     long index = 0;
-    long hash_count = 0;
     Node *n;
 
-    cakelog("beginning loop through buffer using strtok");
+    cakelog("beginning loop through buffer using next_record");
 
-    // Words are pulled out of the data buffer using strtok()
-    // (https://man7.org/linux/man-pages/man3/strtok.3.html) which splits a
-    // block of char data into it's component words (or tokens), according to
-    // the delimeters provided (in this case `\n` for each word and `\0` to get
-    // the last word in the buffer).
+    RecordCursor cursor = { data, data_len, 0 };
+    const char *word;
+    long word_len;
 
-    char * word = strtok(buffer, "\n\0");
-    
-    while( word != NULL) {
+    while (index < word_count && next_record(&cursor, &word, &word_len)) {
 
-        cakelog("next word is [%s]", word);
+        cakelog("next word is [%.*s]", (int)word_len, word);
 
         // A new node is built out of the word. To get the hash of each
         // word the sha256() function is called which wraps calls to the OpenSSL
@@ -326,11 +457,12 @@ Node** build_leaves(char* buffer) {
         // Left and right Nodes are assigned NULL because this is the bottom
         // layer of the tree - there are no branches beneath it
 
-        n = new_node(NULL, NULL, hexdigest(sha256(word)));
+        unsigned char *hash = sha256(word, word_len);
+        n = new_node(NULL, NULL, hexdigest(hash));
+        OPENSSL_free(hash);
+
         leaves[index] = n;
-        hash_count++;
         index++;
-        word = strtok(NULL, "\n\0");
 
     }
 
@@ -339,33 +471,43 @@ Node** build_leaves(char* buffer) {
     return leaves;
 }
 
-// build_merkle_tree() builds our Merkle Tree recursively, layer by layer from
-// the bottom up. It returns a pointer to the 'Node' at the root of the tree.
-// This Node will contain the hash of the entire data-set.
-//
-// The 'previous_layer' parameter is a pointer-chain of 'Node' objects that are
-// used to build the next layer of nodes. The first time this function is
-// called, 'previous_layer' will contain the leaves, or bottom layer, of our
-// tree (see build_leaves() function).
+// is_level_retained() applies a RetentionPolicy (see merkle_tree.h) to level
+// 'level' of a tree that is 'height' levels high.
 
-// The 'previous_layer_len' parameter contains the number of 'Node' pointers in
-// 'previous_layer'. This value is used to calculate the amount of memory needed
-// when allocating our new layer.
+bool is_level_retained(RetentionPolicy policy, int level, int height) {
 
-Node* build_merkle_tree(Node **previous_layer, long previous_layer_len) {
+    if (policy.top_levels == 0 && policy.level_stride == 0) {
+        return true;
+    }
 
-    cakelog("===== build_merkle_tree() =====");
+    if (level == height - 1) {
+        return true;
+    }
 
-    // If the number of Nodes in the previous layer is just 1 then
-    // previous_layer is already at the root of the tree.
+    if (policy.top_levels > 0 && level >= height - policy.top_levels) {
+        return true;
+    }
 
-    if (previous_layer_len == 1) {
+    if (policy.level_stride > 0 && level > 0 && level % policy.level_stride == 0) {
+        return true;
+    }
 
-        cakelog("previous_layer_len is 1 so we have root. Returning previous_layer[0] at address %p", previous_layer[0]);
+    return false;
+}
+
+// build_next_layer() builds one layer of the tree from the layer beneath it.
+//
+// The 'previous_layer' parameter is a pointer-chain of 'Node' objects that are
+// used to build the next layer of nodes and the 'previous_layer_len' parameter
+// contains the number of 'Node' pointers in 'previous_layer'. This value is
+// used to calculate the amount of memory needed when allocating our new layer.
+//
+// The new layer is returned and its length is written to 'new_layer_len'.
+
+Node** build_next_layer(Node **previous_layer, long previous_layer_len, long *new_layer_len) {
+
+    cakelog("===== build_next_layer() =====");
 
-        return previous_layer[0];
-    }
-   
     // A Merkle Tree is also a Perfect Binary Tree
     // (https://www.programiz.com/dsa/perfect-binary-tree) so, in theory, new
     // layers should have half the number of nodes as their previous layer
@@ -385,13 +527,16 @@ Node* build_merkle_tree(Node **previous_layer, long previous_layer_len) {
     Node **next_layer = malloc(sizeof(Node*)*next_layer_len);
 
     cakelog("allocated space for %ld node pointers in next_layer at address %p", next_layer_len, next_layer);
-    printf("allocated space for %ld node pointers in next_layer at address %p\n", next_layer_len, next_layer);
+    if (print_progress) {
+        printf("allocated space for %ld node pointers in next_layer at address %p\n", next_layer_len, next_layer);
+    }
     
-    int next_layer_index = 0;
+    long next_layer_index = 0;
     long previous_layer_left_index = 0;
     long previous_layer_right_index = 0;
     
     Node *n;
+    unsigned char *hash;
     char *digest = malloc(sizeof(char) * 129);
 
     while (previous_layer_left_index < previous_layer_len) {
@@ -430,9 +575,11 @@ Node* build_merkle_tree(Node **previous_layer, long previous_layer_len) {
             // Ordinarily, this only needs to be done when the root node is
             // being displayed
 
+            hash = sha256(digest, 128);
             n = new_node(previous_layer[previous_layer_left_index], 
                          previous_layer[previous_layer_right_index], 
-                         hexdigest(sha256(digest)));
+                         hexdigest(hash));
+            OPENSSL_free(hash);
 
         }
         else {
@@ -449,9 +596,11 @@ Node* build_merkle_tree(Node **previous_layer, long previous_layer_len) {
 
             cakelog("new node concatenated digest is: %s", digest);
 
+            hash = sha256(digest, 128);
             n = new_node(previous_layer[previous_layer_left_index], 
                          previous_layer[previous_layer_left_index], 
-                         hexdigest(sha256(digest)));
+                         hexdigest(hash));
+            OPENSSL_free(hash);
         }
 
         // Add the new Node to the next empty slot in the layer
@@ -464,85 +613,1701 @@ Node* build_merkle_tree(Node **previous_layer, long previous_layer_len) {
         previous_layer_left_index = previous_layer_right_index + 1;
     }
     
-    // The recursive call where the next layer becomes the previous layer
 
-    return build_merkle_tree(next_layer, next_layer_index);
+    free(digest);
+
+    *new_layer_len = next_layer_index;
+
+    return next_layer;
+}
+
+// free_layer() releases a layer of Nodes that the RetentionPolicy has decided
+// not to keep, once the layer above it has been built.
+
+void free_layer(Node **layer, long layer_len) {
+
+    cakelog("===== free_layer() =====");
+
+    for (long i = 0; i < layer_len; i++) {
+        free(layer[i]->sha256_digest);
+        free(layer[i]);
+    }
+
+    free(layer);
+
+    cakelog("freed %ld nodes", layer_len);
 }
 
-// The program uses the cakelog logger
-// (https://github.com/chris-j-akers/cakelog)) which outputs timestamped
-// information to a log file, but this is optional as logging slows the program
-// down, especially if flush is forced.
+// build_merkle_tree() builds our Merkle Tree recursively, layer by layer from
+// the bottom up. It returns a pointer to the 'Node' at the root of the tree.
+// This Node will contain the hash of the entire data-set.
 //
-// Usage (assuming the executable is called 'mtree') is: 
+// The 'level' parameter is the level of the layer that the next layer is
+// built from. The first time this function is called, that will be the
+// frontier: the leaves, or bottom layer, of our tree (see build_leaves()
+// function) unless the RetentionPolicy has dropped them (see build_frontier()
+// function).
+//
+// Once a layer has been used to build the one above it, it's no longer needed
+// to build the rest of the tree so, if the RetentionPolicy hasn't asked for it
+// to be kept, it's freed straight away. This keeps the peak memory used while
+// building close to the memory used by the finished tree.
+
+Node* build_merkle_tree(MerkleTree *tree, int level) {
+
+    cakelog("===== build_merkle_tree() =====");
+
+    Node **previous_layer = tree->levels[level];
+    long previous_layer_len = tree->level_lens[level];
+
+    // If the previous layer is the top level of the tree then it holds the
+    // root. It's the level rather than the number of Nodes that's checked
+    // because a single leaf still has a root built above it (see
+    // set_tree_shape()).
+
+    if (level == tree->height - 1) {
+
+        cakelog("previous_layer_len is 1 so we have root. Returning previous_layer[0] at address %p", previous_layer[0]);
+
+        return previous_layer[0];
+    }
+
+    long next_layer_len;
+    Node **next_layer = build_next_layer(previous_layer, previous_layer_len, &next_layer_len);
+
+    tree->levels[level + 1] = next_layer;
+
+    if (!is_level_retained(tree->policy, level, tree->height)) {
+
+        cakelog("dropping level %d", level);
+
+        // The new Nodes still point at the Nodes about to be freed. They're
+        // left as NULL, just like leaves, and get_digest() works out from the
+        // level it's been asked for whether they need recomputing.
+
+        for (long i = 0; i < next_layer_len; i++) {
+            next_layer[i]->left = NULL;
+            next_layer[i]->right = NULL;
+        }
+
+        free_layer(previous_layer, previous_layer_len);
+        tree->levels[level] = NULL;
+    }
+
+    // The recursive call where the next layer becomes the previous layer
+
+    return build_merkle_tree(tree, level + 1);
+}
+
+// subtree_digest_slot() returns the place in a cached Subtree where the raw
+// digest of the Node at 'level' and 'index' is stored. The first Node on level
+// L underneath the Subtree's root is the one at 'root_index << (S - L)', where
+// S is the 'subtree_level'.
+
+unsigned char* subtree_digest_slot(MerkleTree *tree, Subtree *subtree, int level, long index) {
+
+    const long local_index = index - (subtree->root_index << (tree->subtree_level - level));
+
+    return subtree->digests + ((subtree->level_offsets[level] + local_index) * SHA256_DIGEST_LENGTH);
+}
+
+// compute_subtree() hashes the records underneath the Node at 'level' and
+// 'index' straight from the data file, without building any Nodes, and writes
+// its digest to 'hex_digest'. The records are read from 'cursor', which must
+// be positioned at (or before) the first record underneath the Node.
 //
-//      mtree [-d|-f] <datafile>
+// It follows exactly the same rules as build_next_layer() but works from the
+// top down: a Node's digest is the hash of its left and right childrens'
+// digests concatenated and, if the layer below has an odd number of Nodes and
+// there is no right child, the left child is duplicated. The records are
+// consumed left to right, so one cursor can be passed across every Node on a
+// level in turn.
 //
-// Where <datafile> is the name of an input file that contains a list of words
-// on each line, -d is a request to trace output to a file, and -f is to trace
-// output to a file but also force Cakelog to flush the file each time it's
-// written to (can add considerable processing time).
+// If 'subtree' isn't NULL, the digest of every Node below the Subtree's level
+// is also stored in it (see rebuild_subtree()).
 //
-// The datafile should be a file of words or text separated by a newline
-// character. There are some examples in the ./test-data folder of this repo.
+// false is returned, and 'hex_digest' left unset, if the data runs out before
+// every record underneath the Node has been read. The file must then have been
+// cut short since the tree (or digest set) was made, and as no real record is
+// ever empty the digest couldn't have matched anyway, so nothing more is
+// hashed. This also stops a damaged digest set that claims far more records
+// than the data holds from hashing its way through all of them.
 
-int main(int argc, char *argv[]) {
+bool compute_subtree(MerkleTree *tree, RecordCursor *cursor, int level, long index, Subtree *subtree, char *hex_digest) {
 
-    // Borrow the Cakelogger timstamp function
-    char *timestamp_start = get_timestamp();
-    
-    int opt;
+    if (level == 0) {
 
-    while ((opt = getopt(argc, argv, "df")) != -1) {
-        if ((unsigned char)opt == 'd') {
-            /* debug without flush */
-            cakelog_initialise(argv[0], false);
+        const char *record;
+        long record_len;
+
+        if (!next_record(cursor, &record, &record_len)) {
+            return false;
+        }
+
+        sha256_hex(record, record_len, hex_digest);
+    }
+    else {
+
+        char digest[129];
+        const long left_index = index * 2;
+        const long right_index = left_index + 1;
+
+        if (!compute_subtree(tree, cursor, level - 1, left_index, subtree, digest)) {
+            return false;
         }
-        else if ((unsigned char)opt == 'f') {
-            /* debug with flush */
-            cakelog_initialise(argv[0], true);
+
+        if (right_index < tree->level_lens[level - 1]) {
+            if (!compute_subtree(tree, cursor, level - 1, right_index, subtree, digest + 64)) {
+                return false;
+            }
         }
         else {
-            printf("Usage: %s [-d] <datafile>\n", argv[0]);
-            exit(EXIT_FAILURE);
+            memcpy(digest + 64, digest, 64);
+            digest[128] = '\0';
+        }
+
+        sha256_hex(digest, 128, hex_digest);
+    }
+
+    if (subtree != NULL && level < tree->subtree_level) {
+        digest_from_hex(hex_digest, subtree_digest_slot(tree, subtree, level, index));
+    }
+
+    return true;
+}
+
+// build_frontier() builds the lowest kept layer of the tree straight from the
+// data when the RetentionPolicy has dropped the leaves. A single cursor runs
+// through the whole file, and the position of the first record underneath each
+// frontier Node is noted in 'frontier_offsets' on the way.
+//
+// If the frontier is above the 'subtree_level', the cursor hashes the Nodes on
+// the 'subtree_level' instead and keeps their digests in 'subtree_roots', and
+// where each one starts in 'subtree_offsets'. The frontier Nodes are then
+// hashed from those by get_digest(), which is why the frontier level is only
+// filled in after this returns.
+
+Node** build_frontier(MerkleTree *tree) {
+
+    cakelog("===== build_frontier() =====");
+
+    const long frontier_len = tree->level_lens[tree->frontier];
+
+    Node **frontier = malloc(sizeof(Node*) * frontier_len);
+    tree->frontier_offsets = malloc(sizeof(long) * frontier_len);
+
+    cakelog("allocated space for %ld node pointers and offsets at level %d", frontier_len, tree->frontier);
+
+    RecordCursor cursor = { tree->data, tree->data_len, 0 };
+    char hex_digest[65];
+
+    if (tree->subtree_level < tree->frontier) {
+
+        const int subtree_level = tree->subtree_level;
+        const int levels_between = tree->frontier - subtree_level;
+        const long roots_len = tree->level_lens[subtree_level];
+
+        tree->subtree_roots = malloc(roots_len * SHA256_DIGEST_LENGTH);
+        tree->subtree_offsets = malloc(sizeof(long) * roots_len);
+
+        cakelog("allocated space for %ld subtree roots at level %d", roots_len, subtree_level);
+
+        for (long i = 0; i < roots_len; i++) {
+
+            if ((i & ((1L << levels_between) - 1)) == 0) {
+                tree->frontier_offsets[i >> levels_between] = cursor.pos;
+            }
+
+            tree->subtree_offsets[i] = cursor.pos;
+
+            compute_subtree(tree, &cursor, subtree_level, i, NULL, hex_digest);
+            digest_from_hex(hex_digest, tree->subtree_roots + (i * SHA256_DIGEST_LENGTH));
+        }
+
+        for (long i = 0; i < frontier_len; i++) {
+            get_digest(tree, tree->frontier, i, hex_digest);
+            frontier[i] = new_node(NULL, NULL, strdup(hex_digest));
+        }
+    }
+    else {
+
+        for (long i = 0; i < frontier_len; i++) {
+
+            tree->frontier_offsets[i] = cursor.pos;
+
+            compute_subtree(tree, &cursor, tree->frontier, i, NULL, hex_digest);
+            frontier[i] = new_node(NULL, NULL, strdup(hex_digest));
+        }
+    }
+
+    cakelog("returning %ld frontier nodes", frontier_len);
+
+    return frontier;
+}
+
+// set_tree_shape() fills in the number of leaves, the number of levels and
+// the number of Nodes on each level of a tree with 'leaf_count' leaves. Each
+// level has half the Nodes of the one beneath it, rounded up (see
+// build_next_layer()), until there's only the root left.
+//
+// A single record still gets a root above it, made by pairing its leaf with
+// itself, because that's what merkle_tree.py does and the root digests have
+// to agree.
+//
+// The halves are rounded up without adding 1 first, because 'leaf_count' can
+// come straight from a digest set file (see read_digest_set()) and may be as
+// big as a long can hold.
+
+void set_tree_shape(MerkleTree *tree, long leaf_count) {
+
+    long level_len = leaf_count;
+
+    tree->leaf_count = leaf_count;
+    tree->level_lens[0] = level_len;
+    tree->height = 1;
+
+    do {
+        level_len = (level_len / 2) + (level_len & 1);
+        tree->level_lens[tree->height++] = level_len;
+    } while (level_len > 1);
+}
+
+// build_tree() works out the shape of the tree for the records in 'data' and
+// builds it according to 'policy'. 'cache_capacity' is the number of rebuilt
+// Subtrees to keep for proofs and diffs. The data isn't copied, so it has to
+// stay where it is, unchanged, until the tree is freed.
+//
+// If there are no records in the data there's no tree to build, so NULL is
+// returned with 'errno' set to ENODATA.
+
+MerkleTree* build_tree(const char *data, long data_len, RetentionPolicy policy, int cache_capacity) {
+
+    cakelog("===== build_tree() =====");
+
+    const long leaf_count = get_word_count(data, data_len);
+
+    if (print_progress) {
+        printf("read %ld words into buffer\n", leaf_count);
+    }
+
+    if (leaf_count == 0) {
+        cakelog("no records in data");
+        errno = ENODATA;
+        return NULL;
+    }
+
+    MerkleTree *tree = calloc(1, sizeof(MerkleTree));
+    tree->data = data;
+    tree->data_len = data_len;
+    tree->policy = policy;
+    tree->cache.capacity = cache_capacity < 1 ? 1 : cache_capacity;
+
+    set_tree_shape(tree, leaf_count);
+
+    tree->frontier = 0;
+    while (!is_level_retained(policy, tree->frontier, tree->height)) {
+        tree->frontier++;
+    }
+
+    tree->subtree_level = tree->frontier < MAX_CACHED_SUBTREE_LEVELS ? tree->frontier : MAX_CACHED_SUBTREE_LEVELS;
+
+    cakelog("tree has %d levels, frontier is level %d", tree->height, tree->frontier);
+
+    if (tree->frontier == 0) {
+        if (print_progress) {
+            printf("building leaves...\n");
+        }
+        tree->levels[0] = build_leaves(tree->data, tree->data_len, tree->leaf_count);
+    }
+    else {
+        if (print_progress) {
+            printf("building frontier at level %d...\n", tree->frontier);
+        }
+        tree->levels[tree->frontier] = build_frontier(tree);
+    }
+
+    if (print_progress) {
+        printf("building tree ...\n");
+    }
+
+    build_merkle_tree(tree, tree->frontier);
+
+    if (print_progress && (policy.top_levels > 0 || policy.level_stride > 0)) {
+
+        int retained_levels = 0;
+        long retained_nodes = 0;
+        long total_nodes = 0;
+
+        for (int level = 0; level < tree->height; level++) {
+            total_nodes += tree->level_lens[level];
+            if (tree->levels[level] != NULL) {
+                retained_levels++;
+                retained_nodes += tree->level_lens[level];
+            }
+        }
+
+        printf("retained %d of %d levels (%ld of %ld nodes), lowest retained level is %d\n", retained_levels, tree->height, retained_nodes, total_nodes, tree->frontier);
+    }
+
+    return tree;
+}
+
+// build_tree_from_file() maps the data file (see map_data_file()) and builds
+// the tree from it with build_tree(). The mapping is handed over to the tree
+// and is unmapped when the tree is freed. NULL is returned, with 'errno' set,
+// if the file can't be mapped or has no records in it.
+
+MerkleTree* build_tree_from_file(const char *data_file, RetentionPolicy policy, int cache_capacity) {
+
+    cakelog("===== build_tree_from_file() =====");
+
+    long data_len;
+    char *data = map_data_file(data_file, &data_len);
+
+    if (data == NULL) {
+        return NULL;
+    }
+
+    MerkleTree *tree = build_tree(data, data_len, policy, cache_capacity);
+
+    if (tree == NULL) {
+        const int build_errno = errno;
+        munmap(data, data_len);
+        errno = build_errno;
+        return NULL;
+    }
+
+    tree->data_mapped = true;
+
+    return tree;
+}
+
+// record_offset() returns the byte offset in the data of 'record', which must
+// be underneath the frontier. The offset of the first record underneath each
+// Node on the 'subtree_level' is kept (in 'frontier_offsets' if that's the
+// frontier), so it only has to skip over (not hash) the records before it
+// under the same Node, and none at all for the first record of a Subtree,
+// which is all rebuild_subtree() ever asks for.
+
+long record_offset(MerkleTree *tree, long record) {
+
+    const int level = tree->subtree_offsets != NULL ? tree->subtree_level : tree->frontier;
+    const long *offsets = tree->subtree_offsets != NULL ? tree->subtree_offsets : tree->frontier_offsets;
+    const long index = record >> level;
+
+    RecordCursor cursor = { tree->data, tree->data_len, offsets[index] };
+    const char *skipped;
+    long skipped_len;
+
+    for (long skip = record - (index << level); skip > 0; skip--) {
+        if (!next_record(&cursor, &skipped, &skipped_len)) {
+            break;
         }
     }
 
-	if (optind >= argc) {
-		printf("Missing filename\nUsage: %s [-d|-df] <datafile>\n", argv[0]);
-		exit(EXIT_FAILURE);
-	}
+    return cursor.pos;
+}
+
+// rebuild_subtree() hashes the records underneath the Node at 'root_index' on
+// the tree's 'subtree_level' again and returns a new Subtree holding every
+// digest below it. The rebuilt digest is checked against the one kept for the
+// Node (on the frontier or in 'subtree_roots') as a cheap way of finding out
+// whether the data file has changed since the tree was built, in which case
+// anything worked out from it can't be trusted.
+//
+// The library is also used by long-running callers (the Python module, for
+// instance), so rather than exiting or printing anything, NULL is returned
+// with 'errno' set to ENOMEM if there isn't the memory for the Subtree, or to
+// ESTALE if the data has changed.
+
+Subtree* rebuild_subtree(MerkleTree *tree, long root_index) {
+
+    cakelog("===== rebuild_subtree() =====");
+
+    const int subtree_level = tree->subtree_level;
+
+    Subtree *subtree = malloc(sizeof(Subtree));
+
+    if (subtree == NULL) {
+        cakelog("unable to allocate subtree");
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    subtree->root_index = root_index;
+    subtree->prev = NULL;
+    subtree->next = NULL;
+
+    // Each level of the Subtree is sized to the Nodes that are really there,
+    // which is fewer than 2^(S - L) on the right-hand edge of the tree.
+
+    long digest_count = 0;
+
+    for (int level = 0; level < subtree_level; level++) {
+
+        const long first_index = root_index << (subtree_level - level);
+        long level_len = 1L << (subtree_level - level);
 
-    printf("reading file %s\n", argv[optind]);
+        if (level_len > tree->level_lens[level] - first_index) {
+            level_len = tree->level_lens[level] - first_index;
+        }
+
+        subtree->level_offsets[level] = digest_count;
+        digest_count += level_len;
+    }
 
-    char *words = read_data_file(argv[optind]);
-    long word_count = get_word_count(words);
+    subtree->digests = malloc(digest_count * SHA256_DIGEST_LENGTH);
 
-    printf("read %ld words into buffer\n", word_count);
+    if (subtree->digests == NULL) {
+        cakelog("unable to allocate %ld digests for subtree", digest_count);
+        free(subtree);
+        errno = ENOMEM;
+        return NULL;
+    }
 
-    printf("building leaves...\n");
+    RecordCursor cursor = { tree->data, tree->data_len, record_offset(tree, root_index << subtree_level) };
+    char hex_digest[65];
+    char kept_digest[65];
 
-    Node **leaves = build_leaves(words);
+    if (!compute_subtree(tree, &cursor, subtree_level, root_index, subtree, hex_digest)) {
+        cakelog("data ran out while rebuilding node %ld", root_index);
+        free(subtree->digests);
+        free(subtree);
+        errno = ESTALE;
+        return NULL;
+    }
 
-    printf("building tree ...\n");
-    Node *root = build_merkle_tree(leaves, word_count);
+    get_digest(tree, subtree_level, root_index, kept_digest);
 
-    char *timestamp_stop = get_timestamp();
+    if (strcmp(hex_digest, kept_digest) != 0) {
+        cakelog("rebuilt digest [%s] doesn't match kept digest [%s] of node %ld", hex_digest, kept_digest, root_index);
+        free(subtree->digests);
+        free(subtree);
+        errno = ESTALE;
+        return NULL;
+    }
 
-    printf("\n");
-    printf("================================================================================\n");
-    printf("Root digest is: %s\n", root->sha256_digest);
-    printf("================================================================================\n");
-    printf("\n");
+    cakelog("rebuilt subtree of %ld digests under level %d node %ld", digest_count, subtree_level, root_index);
 
-    // How long did it take?
+    return subtree;
+}
 
-    printf("start:\t%s\n", timestamp_start);
-    printf("finish:\t%s\n", timestamp_stop);
+// fetch_subtree() returns the Subtree underneath the Node at 'root_index' on
+// the tree's 'subtree_level', from the cache if it's there, or by rebuilding
+// it. Either way it's moved to the head of the cache and, if that leaves the
+// cache over capacity, the least recently used Subtree is freed. NULL is
+// returned, with 'errno' set, if it has to be rebuilt and that fails (see
+// rebuild_subtree()).
 
-    free(timestamp_start);
-    free(timestamp_stop);
+Subtree* fetch_subtree(MerkleTree *tree, long root_index) {
 
-    cakelog_stop();
+    SubtreeCache *cache = &tree->cache;
+    Subtree *subtree = cache->head;
 
-}
\ No newline at end of file
+    while (subtree != NULL && subtree->root_index != root_index) {
+        subtree = subtree->next;
+    }
+
+    if (subtree != NULL) {
+
+        cache->hits++;
+
+        if (subtree == cache->head) {
+            return subtree;
+        }
+
+        // Unlink from where it is now, ready to be put back at the head
+
+        subtree->prev->next = subtree->next;
+        if (subtree->next != NULL) {
+            subtree->next->prev = subtree->prev;
+        }
+        else {
+            cache->tail = subtree->prev;
+        }
+    }
+    else {
+
+        cache->misses++;
+        subtree = rebuild_subtree(tree, root_index);
+
+        if (subtree == NULL) {
+            return NULL;
+        }
+
+        cache->count++;
+    }
+
+    subtree->prev = NULL;
+    subtree->next = cache->head;
+    if (cache->head != NULL) {
+        cache->head->prev = subtree;
+    }
+    cache->head = subtree;
+    if (cache->tail == NULL) {
+        cache->tail = subtree;
+    }
+
+    if (cache->count > cache->capacity) {
+
+        Subtree *evicted = cache->tail;
+
+        cakelog("evicting subtree under node %ld", evicted->root_index);
+
+        cache->tail = evicted->prev;
+        cache->tail->next = NULL;
+        cache->count--;
+
+        free(evicted->digests);
+        free(evicted);
+    }
+
+    return subtree;
+}
+
+// get_digest() writes the digest of the Node at 'level' and 'index' to
+// 'hex_digest', wherever it has to come from:
+//
+//      - a kept level: straight from the Node
+//      - below the 'subtree_level': from the cached Subtree it belongs to
+//      - on the 'subtree_level', below the frontier: from 'subtree_roots'
+//      - any other dropped level: by hashing its children, which are found
+//        the same way
+//
+// The digest is copied rather than returned as a pointer because a cached
+// Subtree can be evicted by the very next call. false is returned, with
+// 'errno' set, if a Subtree it needed couldn't be rebuilt (see
+// rebuild_subtree()).
+
+bool get_digest(MerkleTree *tree, int level, long index, char *hex_digest) {
+
+    if (tree->levels[level] != NULL) {
+        memcpy(hex_digest, tree->levels[level][index]->sha256_digest, 65);
+        return true;
+    }
+
+    if (level < tree->subtree_level) {
+
+        Subtree *subtree = fetch_subtree(tree, index >> (tree->subtree_level - level));
+
+        if (subtree == NULL) {
+            return false;
+        }
+
+        digest_to_hex(subtree_digest_slot(tree, subtree, level, index), hex_digest);
+        return true;
+    }
+
+    if (level == tree->subtree_level && tree->subtree_roots != NULL) {
+        digest_to_hex(tree->subtree_roots + (index * SHA256_DIGEST_LENGTH), hex_digest);
+        return true;
+    }
+
+    char digest[129];
+    const long left_index = index * 2;
+    const long right_index = left_index + 1;
+
+    if (!get_digest(tree, level - 1, left_index, digest)) {
+        return false;
+    }
+
+    if (right_index < tree->level_lens[level - 1]) {
+        if (!get_digest(tree, level - 1, right_index, digest + 64)) {
+            return false;
+        }
+    }
+    else {
+        memcpy(digest + 64, digest, 64);
+        digest[128] = '\0';
+    }
+
+    sha256_hex(digest, 128, hex_digest);
+
+    return true;
+}
+
+// root_digest() returns the digest of the root Node, which is always kept.
+
+const char* root_digest(MerkleTree *tree) {
+    return tree->levels[tree->height - 1][0]->sha256_digest;
+}
+
+// get_proof() writes the proof for a single record to 'steps', which must
+// have room for 'height - 1' ProofSteps, and the digest of the record itself
+// to 'leaf_digest'. Anyone holding the record and the root digest can use the
+// proof to check the record belongs to the tree (see fold_proof()).
+//
+// The number of steps is returned, or -1 with 'errno' set to ERANGE if
+// 'record' is out of range, or as get_digest() left it if a digest couldn't be
+// worked out.
+
+int get_proof(MerkleTree *tree, long record, char *leaf_digest, ProofStep *steps) {
+
+    cakelog("===== get_proof() =====");
+
+    if (record < 0 || record >= tree->leaf_count) {
+        cakelog("record %ld is out of range", record);
+        errno = ERANGE;
+        return -1;
+    }
+
+    long index = record;
+
+    if (!get_digest(tree, 0, index, leaf_digest)) {
+        return -1;
+    }
+
+    for (int level = 0; level < tree->height - 1; level++) {
+
+        // The last Node on a level with an odd number of Nodes was paired with
+        // itself.
+
+        long sibling_index = index ^ 1;
+        if (sibling_index >= tree->level_lens[level]) {
+            sibling_index = index;
+        }
+
+        if (!get_digest(tree, level, sibling_index, steps[level].sibling_digest)) {
+            return -1;
+        }
+        steps[level].sibling_is_left = (index % 2 == 1);
+
+        index /= 2;
+    }
+
+    return tree->height - 1;
+}
+
+// fold_proof() hashes a record's digest together with each step of its proof
+// in turn and writes the result to 'hex_digest'. If the record and the proof
+// are genuine, the result is the root digest of the tree.
+
+void fold_proof(const char *leaf_digest, const ProofStep *steps, int step_count, char *hex_digest) {
+
+    char digest[129];
+
+    memcpy(hex_digest, leaf_digest, 65);
+
+    for (int i = 0; i < step_count; i++) {
+
+        if (steps[i].sibling_is_left) {
+            memcpy(digest, steps[i].sibling_digest, 64);
+            memcpy(digest + 64, hex_digest, 64);
+        }
+        else {
+            memcpy(digest, hex_digest, 64);
+            memcpy(digest + 64, steps[i].sibling_digest, 64);
+        }
+
+        sha256_hex(digest, 128, hex_digest);
+    }
+}
+
+// add_diff_range() adds a run of records found to differ to a DiffList,
+// either by extending the last DiffRange, if the run follows on from it, or by
+// starting a new one. Runs have to be added in order.
+
+void add_diff_range(DiffList *diff, long first, long last) {
+
+    if (diff->count > 0 && diff->ranges[diff->count - 1].last == first - 1) {
+        diff->ranges[diff->count - 1].last = last;
+        return;
+    }
+
+    if (diff->count == diff->capacity) {
+        diff->capacity = diff->capacity == 0 ? 16 : diff->capacity * 2;
+        diff->ranges = realloc(diff->ranges, sizeof(DiffRange) * diff->capacity);
+    }
+
+    diff->ranges[diff->count].first = first;
+    diff->ranges[diff->count].last = last;
+    diff->count++;
+}
+
+// diff_subtrees() walks two trees built from the same number of records from
+// the top down. Wherever the digests of a Node match, everything underneath it
+// matches too and it can be skipped, so only the branches that lead to changed
+// records are ever visited (or, below the frontier, rebuilt). It gives up and
+// returns false as soon as a digest can't be worked out (see get_digest()).
+
+bool diff_subtrees(MerkleTree *tree_a, MerkleTree *tree_b, int level, long index, DiffList *diff) {
+
+    char digest_a[65];
+    char digest_b[65];
+
+    if (!get_digest(tree_a, level, index, digest_a) || !get_digest(tree_b, level, index, digest_b)) {
+        return false;
+    }
+
+    if (strcmp(digest_a, digest_b) == 0) {
+        return true;
+    }
+
+    if (level == 0) {
+        add_diff_range(diff, index, index);
+        return true;
+    }
+
+    const long left_index = index * 2;
+    const long right_index = left_index + 1;
+
+    if (!diff_subtrees(tree_a, tree_b, level - 1, left_index, diff)) {
+        return false;
+    }
+
+    if (right_index < tree_a->level_lens[level - 1]) {
+        return diff_subtrees(tree_a, tree_b, level - 1, right_index, diff);
+    }
+
+    return true;
+}
+
+// diff_trees() fills 'diff' with the runs of records that differ between two
+// trees. Trees built from a different number of records have a different
+// shape, so every Node from the first changed record onwards would differ
+// anyway; false is returned in that case, with 'errno' set to EINVAL, and
+// 'diff' is left empty. false is also returned, with 'errno' set by
+// get_digest(), if a digest couldn't be worked out.
+//
+// 'diff' should start out zeroed and be released with free_diff() whatever
+// is returned.
+
+bool diff_trees(MerkleTree *tree_a, MerkleTree *tree_b, DiffList *diff) {
+
+    cakelog("===== diff_trees() =====");
+
+    if (tree_a->leaf_count != tree_b->leaf_count) {
+        cakelog("record counts differ (%ld vs %ld)", tree_a->leaf_count, tree_b->leaf_count);
+        errno = EINVAL;
+        return false;
+    }
+
+    if (!diff_subtrees(tree_a, tree_b, tree_a->height - 1, 0, diff)) {
+        cakelog("unable to work out digests: %s", strerror(errno));
+        return false;
+    }
+
+    cakelog("found %ld differing ranges", diff->count);
+
+    return true;
+}
+
+void free_diff(DiffList *diff) {
+    free(diff->ranges);
+    diff->ranges = NULL;
+    diff->count = 0;
+    diff->capacity = 0;
+}
+
+// free_tree() releases every kept layer, the cached Subtrees and, if the tree
+// was built by build_tree_from_file(), the mapping of the data file.
+
+void free_tree(MerkleTree *tree) {
+
+    cakelog("===== free_tree() =====");
+
+    for (int level = 0; level < tree->height; level++) {
+        if (tree->levels[level] != NULL) {
+            free_layer(tree->levels[level], tree->level_lens[level]);
+        }
+    }
+
+    Subtree *subtree = tree->cache.head;
+    while (subtree != NULL) {
+        Subtree *next = subtree->next;
+        free(subtree->digests);
+        free(subtree);
+        subtree = next;
+    }
+
+    free(tree->frontier_offsets);
+    free(tree->subtree_roots);
+    free(tree->subtree_offsets);
+
+    if (tree->data_mapped) {
+        munmap((void *)tree->data, tree->data_len);
+    }
+
+    free(tree);
+}
+
+// make_digest_set() collects the digests of every level of a tree from
+// 'base_level' up to the root into a new DigestSet, ready to be written out
+// with write_digest_set() and checked against later with verify_data(). If the
+// tree isn't that high, the base level is moved down to the root.
+//
+// If the base level has been kept its digests are copied from the Nodes and
+// the records are only skipped over to find where each block starts.
+// Otherwise a single RecordCursor runs through the data once, hashing each
+// block with compute_subtree() and noting where it starts on the way, as
+// build_frontier() does. Asking get_digest() for each Node instead would
+// rebuild every cached Subtree once for every level below the
+// 'subtree_level'. Either way the levels above are hashed from the base
+// level, and the top one has to come out as the tree's root.
+//
+// NULL is returned, with 'errno' set to ENOMEM if there isn't the memory for
+// the digests, or to ESTALE if the data no longer hashes to the tree's root.
+
+DigestSet* make_digest_set(MerkleTree *tree, int base_level) {
+
+    cakelog("===== make_digest_set() =====");
+
+    DigestSet *set = calloc(1, sizeof(DigestSet));
+
+    if (set == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (base_level < 0) {
+        free(set);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (base_level > tree->height - 1) {
+        base_level = tree->height - 1;
+    }
+
+    set->leaf_count = tree->leaf_count;
+    set->data_len = tree->data_len;
+    set->height = tree->height;
+    set->base_level = base_level;
+    memcpy(set->level_lens, tree->level_lens, sizeof(set->level_lens));
+
+    const long block_count = tree->level_lens[base_level];
+    const long block_len = 1L << base_level;
+
+    set->block_offsets = malloc(sizeof(long) * block_count);
+
+    if (set->block_offsets == NULL) {
+        free_digest_set(set);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (int level = base_level; level < tree->height; level++) {
+
+        set->digests[level] = malloc(tree->level_lens[level] * SHA256_DIGEST_LENGTH);
+
+        if (set->digests[level] == NULL) {
+            free_digest_set(set);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    RecordCursor cursor = { tree->data, tree->data_len, 0 };
+    char hex_digest[65];
+
+    for (long block = 0; block < block_count; block++) {
+
+        set->block_offsets[block] = cursor.pos;
+
+        if (tree->levels[base_level] != NULL) {
+
+            const char *record;
+            long record_len;
+
+            for (long i = 0; i < block_len && next_record(&cursor, &record, &record_len); i++) {
+                // skip to the start of the next block
+            }
+
+            memcpy(hex_digest, tree->levels[base_level][block]->sha256_digest, 65);
+        }
+        else if (!compute_subtree(tree, &cursor, base_level, block, NULL, hex_digest)) {
+            cakelog("data ran out while hashing block %ld", block);
+            free_digest_set(set);
+            errno = ESTALE;
+            return NULL;
+        }
+
+        digest_from_hex(hex_digest, set->digests[base_level] + (block * SHA256_DIGEST_LENGTH));
+    }
+
+    // Each level above is built from the one beneath it exactly as
+    // build_next_layer() does, with the last Node duplicated if it has no
+    // partner.
+
+    char digest[129];
+
+    for (int level = base_level + 1; level < tree->height; level++) {
+
+        const unsigned char *below = set->digests[level - 1];
+        const long below_len = tree->level_lens[level - 1];
+
+        for (long i = 0; i < tree->level_lens[level]; i++) {
+
+            const long left_index = i * 2;
+            const long right_index = left_index + 1 < below_len ? left_index + 1 : left_index;
+
+            digest_to_hex(below + (left_index * SHA256_DIGEST_LENGTH), digest);
+            digest_to_hex(below + (right_index * SHA256_DIGEST_LENGTH), digest + 64);
+            sha256_hex(digest, 128, hex_digest);
+            digest_from_hex(hex_digest, set->digests[level] + (i * SHA256_DIGEST_LENGTH));
+        }
+    }
+
+    digest_to_hex(set->digests[tree->height - 1], hex_digest);
+
+    if (strcmp(hex_digest, root_digest(tree)) != 0) {
+        cakelog("digest set root [%s] doesn't match the tree's root", hex_digest);
+        free_digest_set(set);
+        errno = ESTALE;
+        return NULL;
+    }
+
+    cakelog("digest set has %ld blocks of %ld records from level %d", block_count, block_len, base_level);
+
+    return set;
+}
+
+// A digest set file is a fixed-size header followed by the block offsets and
+// then the raw 32-byte digests of each level from the base level upwards, all
+// in the byte order of the machine that wrote it:
+//
+//      char    magic[8]            "MTDIGST1"
+//      int64   leaf_count
+//      int64   data_len
+//      int32   height
+//      int32   base_level
+//      int64   block_offsets[level_lens[base_level]]
+//      uint8   digests[level_lens[level]][32], for each level in turn
+
+static const char DIGEST_SET_MAGIC[8] = { 'M', 'T', 'D', 'I', 'G', 'S', 'T', '1' };
+
+// write_digest_set() writes 'set' to 'digest_file'. It returns false, with
+// 'errno' set, if the file can't be written.
+
+bool write_digest_set(DigestSet *set, const char *digest_file) {
+
+    cakelog("===== write_digest_set() =====");
+
+    FILE *file = fopen(digest_file, "wb");
+    if (file == NULL) {
+        cakelog("failed to open file: '%s'", digest_file);
+        return false;
+    }
+
+    int64_t leaf_count = set->leaf_count;
+    int64_t data_len = set->data_len;
+    int32_t height = set->height;
+    int32_t base_level = set->base_level;
+
+    bool written = fwrite(DIGEST_SET_MAGIC, sizeof(DIGEST_SET_MAGIC), 1, file) == 1
+                && fwrite(&leaf_count, sizeof(leaf_count), 1, file) == 1
+                && fwrite(&data_len, sizeof(data_len), 1, file) == 1
+                && fwrite(&height, sizeof(height), 1, file) == 1
+                && fwrite(&base_level, sizeof(base_level), 1, file) == 1;
+
+    const long block_count = set->level_lens[set->base_level];
+
+    for (long block = 0; written && block < block_count; block++) {
+        int64_t offset = set->block_offsets[block];
+        written = fwrite(&offset, sizeof(offset), 1, file) == 1;
+    }
+
+    for (int level = set->base_level; written && level < set->height; level++) {
+        const size_t level_len = set->level_lens[level];
+        written = fwrite(set->digests[level], SHA256_DIGEST_LENGTH, level_len, file) == level_len;
+    }
+
+    if (fclose(file) != 0) {
+        written = false;
+    }
+
+    cakelog("%s digest set to %s", written ? "wrote" : "failed to write", digest_file);
+
+    return written;
+}
+
+// read_digest_set() reads a DigestSet back from 'digest_file'. NULL is
+// returned, with 'errno' set, if the file can't be read, with 'errno' set to
+// EINVAL if it isn't a digest set or doesn't hang together, or ENOMEM if
+// there isn't the memory to hold it.
+
+DigestSet* read_digest_set(const char *digest_file) {
+
+    cakelog("===== read_digest_set() =====");
+
+    FILE *file = fopen(digest_file, "rb");
+    if (file == NULL) {
+        cakelog("failed to open file: '%s'", digest_file);
+        return NULL;
+    }
+
+    char magic[sizeof(DIGEST_SET_MAGIC)];
+    int64_t leaf_count;
+    int64_t data_len;
+    int32_t height;
+    int32_t base_level;
+
+    bool valid = fread(magic, sizeof(magic), 1, file) == 1
+              && memcmp(magic, DIGEST_SET_MAGIC, sizeof(magic)) == 0
+              && fread(&leaf_count, sizeof(leaf_count), 1, file) == 1
+              && fread(&data_len, sizeof(data_len), 1, file) == 1
+              && fread(&height, sizeof(height), 1, file) == 1
+              && fread(&base_level, sizeof(base_level), 1, file) == 1
+              && leaf_count > 0
+              && data_len >= leaf_count
+              && base_level >= 0
+              && base_level < 63;
+
+    int read_errno = EINVAL;
+
+    DigestSet *set = calloc(1, sizeof(DigestSet));
+
+    if (set == NULL) {
+        fclose(file);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (valid) {
+
+        // Every record takes at least one byte of data, and a block of
+        // 2^base_level records has to fit in a long, which is what rules out
+        // the header's counts above. The height is worked out again from the
+        // number of leaves rather than trusted, and the size of the file has
+        // to be exactly what the header says it should be, before anything
+        // is allocated. That way a damaged header can't ask for more memory
+        // than the file could ever fill or send the reads below off the end
+        // of anything.
+
+        MerkleTree shape;
+        set_tree_shape(&shape, leaf_count);
+
+        valid = shape.height == height && base_level < height;
+
+        struct stat file_stats;
+        valid = valid && fstat(fileno(file), &file_stats) == 0;
+
+        if (valid) {
+
+            const uint64_t header_len = sizeof(DIGEST_SET_MAGIC) + sizeof(leaf_count) + sizeof(data_len) + sizeof(height) + sizeof(base_level);
+            const uint64_t block_count = shape.level_lens[base_level];
+
+            uint64_t digest_count = 0;
+            for (int level = base_level; level < height; level++) {
+                digest_count += shape.level_lens[level];
+            }
+
+            // Each part is checked against what's left of the file before
+            // it's multiplied up, so none of the sums can overflow.
+
+            uint64_t remaining = file_stats.st_size >= (off_t)header_len ? (uint64_t)file_stats.st_size - header_len : 0;
+
+            valid = file_stats.st_size >= (off_t)header_len
+                 && block_count <= remaining / sizeof(int64_t);
+
+            if (valid) {
+                remaining -= block_count * sizeof(int64_t);
+                valid = remaining % SHA256_DIGEST_LENGTH == 0 && digest_count == remaining / SHA256_DIGEST_LENGTH;
+            }
+
+            if (!valid) {
+                cakelog("%s is %ld bytes, which doesn't match its header", digest_file, (long)file_stats.st_size);
+            }
+        }
+
+        set->leaf_count = leaf_count;
+        set->data_len = data_len;
+        set->height = height;
+        set->base_level = base_level;
+        memcpy(set->level_lens, shape.level_lens, sizeof(set->level_lens));
+    }
+
+    if (valid) {
+
+        const long block_count = set->level_lens[base_level];
+        set->block_offsets = malloc(sizeof(long) * block_count);
+
+        if (set->block_offsets == NULL) {
+            valid = false;
+            read_errno = ENOMEM;
+        }
+
+        for (long block = 0; valid && block < block_count; block++) {
+            int64_t offset;
+            valid = fread(&offset, sizeof(offset), 1, file) == 1 && offset >= 0;
+            set->block_offsets[block] = offset;
+        }
+
+        for (int level = base_level; valid && level < height; level++) {
+            const size_t level_len = set->level_lens[level];
+            set->digests[level] = malloc(level_len * SHA256_DIGEST_LENGTH);
+
+            if (set->digests[level] == NULL) {
+                valid = false;
+                read_errno = ENOMEM;
+                break;
+            }
+
+            valid = fread(set->digests[level], SHA256_DIGEST_LENGTH, level_len, file) == level_len;
+        }
+
+        valid = valid && fgetc(file) == EOF;
+    }
+
+    fclose(file);
+
+    if (!valid) {
+        cakelog("%s is not a valid digest set", digest_file);
+        free_digest_set(set);
+        errno = read_errno;
+        return NULL;
+    }
+
+    cakelog("read digest set of %ld records from %s", set->leaf_count, digest_file);
+
+    return set;
+}
+
+void free_digest_set(DigestSet *set) {
+
+    for (int level = 0; level < MAX_TREE_HEIGHT; level++) {
+        free(set->digests[level]);
+    }
+
+    free(set->block_offsets);
+    free(set);
+}
+
+// check_digest_set() rehashes every level of a DigestSet above the base level
+// from the level beneath it. Unless it all leads back up to the stored root,
+// a matching block proves nothing, so verify_data() does this first.
+//
+// Every Node above the base level is checked against the stored digests of
+// its children rather than ones worked out on the way up, so the Nodes can be
+// checked in any order. With a low base level there can be nearly as many of
+// them as there are records, so they're numbered from the bottom level up and
+// split evenly between 'thread_count' threads, each of which runs
+// check_digest_range() over its share. That keeps the up-front cost of a low
+// base level (roughly one hash per block) spread over the same threads that
+// then hash the blocks.
+
+struct CheckRange {
+    DigestSet *set;
+    long from;
+    long to;
+    atomic_bool *failed;
+};
+
+typedef struct CheckRange CheckRange;
+
+void* check_digest_range(void *arg) {
+
+    CheckRange *range = arg;
+    DigestSet *set = range->set;
+
+    char digest[129];
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+
+    // Find the level and the index on it of the first Node in the range.
+
+    int level = set->base_level + 1;
+    long i = range->from;
+
+    while (level < set->height && i >= set->level_lens[level]) {
+        i -= set->level_lens[level];
+        level++;
+    }
+
+    for (long checked = range->from; checked < range->to && !atomic_load(range->failed); checked++) {
+
+        const unsigned char *below = set->digests[level - 1];
+        const long left_index = i * 2;
+        const long right_index = left_index + 1 < set->level_lens[level - 1] ? left_index + 1 : left_index;
+
+        digest_to_hex(below + (left_index * SHA256_DIGEST_LENGTH), digest);
+        digest_to_hex(below + (right_index * SHA256_DIGEST_LENGTH), digest + 64);
+        sha256_hex(digest, 128, digest);
+        digest_from_hex(digest, hash);
+
+        if (memcmp(hash, set->digests[level] + (i * SHA256_DIGEST_LENGTH), SHA256_DIGEST_LENGTH) != 0) {
+            cakelog("digest set is inconsistent at level %d, node %ld", level, i);
+            atomic_store(range->failed, true);
+            break;
+        }
+
+        if (++i == set->level_lens[level]) {
+            i = 0;
+            level++;
+        }
+    }
+
+    return NULL;
+}
+
+bool check_digest_set(DigestSet *set, int thread_count) {
+
+    long node_count = 0;
+
+    for (int level = set->base_level + 1; level < set->height; level++) {
+        node_count += set->level_lens[level];
+    }
+
+    // Starting a thread costs more than hashing a few thousand Nodes, so a
+    // small set is checked on fewer threads.
+
+    if (thread_count > (node_count / 4096) + 1) {
+        thread_count = (node_count / 4096) + 1;
+    }
+
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+
+    atomic_bool failed;
+    atomic_init(&failed, false);
+
+    CheckRange *ranges = malloc(sizeof(CheckRange) * thread_count);
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+
+    for (int t = 0; t < thread_count; t++) {
+        ranges[t].set = set;
+        ranges[t].from = node_count * t / thread_count;
+        ranges[t].to = node_count * (t + 1) / thread_count;
+        ranges[t].failed = &failed;
+        pthread_create(&threads[t], NULL, check_digest_range, &ranges[t]);
+    }
+
+    for (int t = 0; t < thread_count; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    free(ranges);
+    free(threads);
+
+    return !atomic_load(&failed);
+}
+
+// Verification splits the data into the blocks of the DigestSet and hands
+// them out to a pool of threads. VerifyJob is the state they share.
+// 'next_block' is the next block nobody has claimed yet, and 'stop' is raised
+// when enough mismatches have been found or a block is found not to start
+// where it was saved, after which no more blocks are claimed.
+//
+// Each block is hashed from 'block_starts', which start out as the offsets
+// saved in the DigestSet. If a record before a block has changed length,
+// though, every record after it has moved, the saved offsets point at the
+// wrong place and those blocks would all fail even though their records are
+// intact. So a failed block only counts once its start is known to be right:
+// 'confirmed' is the number of blocks, from block 0, that have been hashed
+// and each start exactly where the block before it really ended (see
+// confirm_blocks()). Only confirmed blocks are reported.
+//
+// When the first block that doesn't line up is found ('misaligned_block'),
+// the real starts of it and every block after it are worked out with a quick
+// scan for newlines (see find_block_starts()) and the blocks are handed back
+// to the threads. 'lock' guards everything from 'block_done' down.
+//
+// 'shape' is a MerkleTree with nothing in it but the number of Nodes on each
+// level, which is all compute_subtree() needs to hash a block.
+
+struct VerifyJob {
+    const char *data;
+    long data_len;
+    DigestSet *set;
+    MerkleTree shape;
+    long max_mismatches;
+    atomic_long next_block;
+    atomic_bool stop;
+    long *block_starts;
+    pthread_mutex_t lock;
+    bool *block_done;
+    bool *block_failed;
+    long *block_ends;
+    long confirmed;
+    long mismatch_count;
+    long misaligned_block;
+};
+
+typedef struct VerifyJob VerifyJob;
+
+// verify_block() hashes one block, starting at byte 'start' in the data, and
+// compares it with the stored digest. If the data runs out before the block
+// does (the file has been cut short) the block fails straight away. Where the
+// block ended is written to 'block_end'.
+
+bool verify_block(VerifyJob *job, long block, long start, long *block_end) {
+
+    const int base_level = job->set->base_level;
+
+    char hex_digest[65];
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+
+    RecordCursor cursor = { job->data, job->data_len, start };
+
+    const bool complete = compute_subtree(&job->shape, &cursor, base_level, block, NULL, hex_digest);
+
+    *block_end = cursor.pos;
+
+    if (!complete) {
+        return false;
+    }
+
+    digest_from_hex(hex_digest, hash);
+
+    return memcmp(hash, job->set->digests[base_level] + (block * SHA256_DIGEST_LENGTH), SHA256_DIGEST_LENGTH) == 0;
+}
+
+// confirm_blocks() moves 'confirmed' on past every block that has been hashed
+// and starts where the block before it ended, counting the failed ones, and
+// raises 'stop' once 'max_mismatches' of them have failed or a block turns out
+// not to start where it should. It's called with 'lock' held each time a block
+// is finished.
+
+void confirm_blocks(VerifyJob *job) {
+
+    const long block_count = job->set->level_lens[job->set->base_level];
+
+    while (job->confirmed < block_count && job->block_done[job->confirmed] && !atomic_load(&job->stop)) {
+
+        const long block = job->confirmed;
+
+        if (block > 0 && job->block_starts[block] != job->block_ends[block - 1]) {
+            cakelog("block %ld starts at %ld rather than %ld", block, job->block_ends[block - 1], job->block_starts[block]);
+            job->misaligned_block = block;
+            atomic_store(&job->stop, true);
+            return;
+        }
+
+        job->confirmed++;
+
+        if (job->block_failed[block]) {
+
+            job->mismatch_count++;
+
+            if (job->max_mismatches > 0 && job->mismatch_count >= job->max_mismatches) {
+                atomic_store(&job->stop, true);
+            }
+        }
+    }
+}
+
+void* verify_worker(void *arg) {
+
+    VerifyJob *job = arg;
+    const long block_count = job->set->level_lens[job->set->base_level];
+
+    while (!atomic_load(&job->stop)) {
+
+        const long block = atomic_fetch_add(&job->next_block, 1);
+        if (block >= block_count) {
+            break;
+        }
+
+        // Blocks that were already hashed from the right place before a
+        // misaligned block was found don't need hashing again.
+
+        if (job->block_done[block]) {
+            continue;
+        }
+
+        long block_end;
+        const bool failed = !verify_block(job, block, job->block_starts[block], &block_end);
+
+        pthread_mutex_lock(&job->lock);
+
+        job->block_failed[block] = failed;
+        job->block_ends[block] = block_end;
+        job->block_done[block] = true;
+        confirm_blocks(job);
+
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    return NULL;
+}
+
+// run_verify_workers() hashes blocks from 'next_block' onwards on
+// 'thread_count' threads until they run out or 'stop' is raised.
+
+void run_verify_workers(VerifyJob *job, int thread_count) {
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_create(&threads[i], NULL, verify_worker, job);
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+}
+
+// A ScanChunk is one thread's share of the data in find_block_starts(). The
+// chunk covers the bytes from 'from' up to (not including) 'to'.
+
+struct ScanChunk {
+    VerifyJob *job;
+    long from;
+    long to;
+    long ends_before;
+    long end_count;
+    bool record_starts;
+};
+
+typedef struct ScanChunk ScanChunk;
+
+// scan_chunk() counts the records that end in its chunk of the data. A record
+// ends at a newline, or the end of the data, straight after a character that
+// isn't a newline, which is exactly where a RecordCursor stops after reading
+// it. Once the number of records ending in every earlier chunk is known
+// ('ends_before'), it's run again with 'record_starts' set to note down where
+// each block starts: straight after the last record of the block before.
+
+void* scan_chunk(void *arg) {
+
+    ScanChunk *chunk = arg;
+    VerifyJob *job = chunk->job;
+
+    const char *data = job->data;
+    const long block_count = job->set->level_lens[job->set->base_level];
+    const long block_len = 1L << job->set->base_level;
+    const long scan_start = job->block_starts[job->misaligned_block];
+
+    long end_count = chunk->ends_before;
+    long pos = chunk->from;
+
+    while (pos <= chunk->to) {
+
+        // The last chunk also has to check the end of the data, in case the
+        // final record has no newline after it.
+
+        long end;
+        const char *newline = memchr(data + pos, '\n', chunk->to - pos);
+
+        if (newline != NULL) {
+            end = newline - data;
+        }
+        else if (chunk->to == job->data_len) {
+            end = job->data_len;
+        }
+        else {
+            break;
+        }
+
+        if (end > scan_start && data[end - 1] != '\n') {
+
+            end_count++;
+
+            if (chunk->record_starts && end_count % block_len == 0) {
+
+                const long block = job->misaligned_block + (end_count / block_len);
+
+                if (block < block_count) {
+                    job->block_starts[block] = end;
+                }
+            }
+        }
+
+        pos = end + 1;
+    }
+
+    chunk->end_count = end_count - chunk->ends_before;
+
+    return NULL;
+}
+
+// find_block_starts() works out where the misaligned block, and every block
+// after it, really starts. The misaligned block starts where the block before
+// it ended. After that, the data is split between 'thread_count' threads which
+// count the records ending in their share of it, and then go over it again to
+// pick out where each block starts now that they know how many records come
+// before their share. Blocks past the last record start at the end of the
+// data, so they fail when they're hashed.
+//
+// Blocks that were hashed before the misaligned block was found, from the
+// place they really start, keep their results; the rest are marked to be
+// hashed again.
+
+void find_block_starts(VerifyJob *job, int thread_count) {
+
+    cakelog("===== find_block_starts() =====");
+
+    const long block_count = job->set->level_lens[job->set->base_level];
+    const long first_block = job->misaligned_block;
+    const long scan_start = job->block_ends[first_block - 1];
+
+    job->block_starts[first_block] = scan_start;
+
+    for (long block = first_block + 1; block < block_count; block++) {
+        job->block_starts[block] = job->data_len;
+    }
+
+    ScanChunk *chunks = malloc(sizeof(ScanChunk) * thread_count);
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+
+    const long scan_len = job->data_len - scan_start;
+
+    for (int i = 0; i < thread_count; i++) {
+        chunks[i].job = job;
+        chunks[i].from = scan_start + (scan_len * i / thread_count);
+        chunks[i].to = scan_start + (scan_len * (i + 1) / thread_count);
+        chunks[i].ends_before = 0;
+        chunks[i].record_starts = false;
+    }
+
+    // The first pass only counts; the second knows how many records end
+    // before each chunk and notes where the blocks start.
+
+    for (int pass = 0; pass < 2; pass++) {
+
+        if (pass == 1) {
+
+            long ends_before = 0;
+
+            for (int i = 0; i < thread_count; i++) {
+                chunks[i].ends_before = ends_before;
+                chunks[i].record_starts = true;
+                ends_before += chunks[i].end_count;
+            }
+        }
+
+        for (int i = 0; i < thread_count; i++) {
+            pthread_create(&threads[i], NULL, scan_chunk, &chunks[i]);
+        }
+
+        for (int i = 0; i < thread_count; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    free(chunks);
+    free(threads);
+
+    for (long block = first_block; block < block_count; block++) {
+        if (job->block_starts[block] != job->set->block_offsets[block]) {
+            job->block_done[block] = false;
+        }
+    }
+}
+
+// verify_data() checks the records in 'data' against a DigestSet using
+// 'thread_count' threads, rehashing each block and comparing it with the
+// stored digest as soon as it's done rather than waiting for the whole tree.
+// It stops after 'max_mismatches' blocks have failed (0 means check
+// everything) and fills in 'result', including the runs of records in the
+// failed blocks. 'result->mismatches' should be released with free_diff().
+//
+// Because a failed block is found without hashing anything after it, a replica
+// that is damaged near the start is rejected almost straight away. A block
+// can't be narrowed down any further than its own records, though, because
+// the digests beneath the base level aren't stored.
+//
+// true is returned if every record matched.
+
+bool verify_data(const char *data, long data_len, DigestSet *set, int thread_count, long max_mismatches, VerifyResult *result) {
+
+    cakelog("===== verify_data() =====");
+
+    const int base_level = set->base_level;
+    const long block_count = set->level_lens[base_level];
+    const long block_len = 1L << base_level;
+
+    memset(result, 0, sizeof(VerifyResult));
+    result->block_count = block_count;
+
+    if (!check_digest_set(set, thread_count)) {
+        cakelog("digest set doesn't lead back to its own root");
+        return false;
+    }
+
+    result->digest_set_consistent = true;
+
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+
+    if (thread_count > block_count) {
+        thread_count = block_count;
+    }
+
+    VerifyJob job;
+    job.data = data;
+    job.data_len = data_len;
+    job.set = set;
+    set_tree_shape(&job.shape, set->leaf_count);
+    job.shape.frontier = base_level;
+    job.max_mismatches = max_mismatches;
+    atomic_init(&job.next_block, 0);
+    atomic_init(&job.stop, false);
+    pthread_mutex_init(&job.lock, NULL);
+    job.block_starts = malloc(sizeof(long) * block_count);
+    job.block_done = calloc(block_count, sizeof(bool));
+    job.block_failed = calloc(block_count, sizeof(bool));
+    job.block_ends = malloc(sizeof(long) * block_count);
+    job.confirmed = 0;
+    job.mismatch_count = 0;
+    job.misaligned_block = -1;
+
+    memcpy(job.block_starts, set->block_offsets, sizeof(long) * block_count);
+
+    cakelog("verifying %ld blocks of %ld records with %d threads", block_count, block_len, thread_count);
+
+    run_verify_workers(&job, thread_count);
+
+    // If a record has changed length, the blocks after it have moved. Find
+    // where they are now and hand them back to the threads, starting from the
+    // first one that didn't line up. Every block from there on starts in the
+    // right place, so this only ever has to be done once.
+
+    if (job.misaligned_block != -1) {
+
+        find_block_starts(&job, thread_count);
+
+        atomic_store(&job.next_block, job.misaligned_block);
+        atomic_store(&job.stop, false);
+        job.misaligned_block = -1;
+
+        run_verify_workers(&job, thread_count);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+
+    const long data_end = job.confirmed > 0 ? job.block_ends[job.confirmed - 1] : 0;
+
+    result->blocks_checked = job.confirmed;
+    result->stopped_early = result->blocks_checked < block_count;
+
+    // Each failed block covers a run of records and add_diff_range() joins
+    // neighbouring failed blocks up into a single run.
+
+    for (long block = 0; block < result->blocks_checked; block++) {
+
+        if (!job.block_failed[block]) {
+            continue;
+        }
+
+        const long first = block * block_len;
+        const long last = first + block_len - 1 < set->leaf_count - 1 ? first + block_len - 1 : set->leaf_count - 1;
+
+        add_diff_range(&result->mismatches, first, last);
+        result->mismatched_blocks++;
+    }
+
+    free(job.block_starts);
+    free(job.block_done);
+    free(job.block_failed);
+    free(job.block_ends);
+
+    // If every block matched, the only thing left that could be wrong is
+    // extra records tacked on after the last one.
+
+    if (!result->stopped_early && result->mismatched_blocks == 0) {
+
+        RecordCursor cursor = { data, data_len, data_end };
+        const char *record;
+        long record_len;
+
+        result->extra_records = next_record(&cursor, &record, &record_len);
+    }
+
+    cakelog("checked %ld of %ld blocks, %ld mismatched", result->blocks_checked, block_count, result->mismatched_blocks);
+
+    return result->mismatched_blocks == 0 && !result->extra_records;
+}
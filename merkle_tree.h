@@ -0,0 +1,268 @@
+#ifndef MERKLE_TREE_H
+#define MERKLE_TREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A tree is made up of Nodes and a Node can be implemented as a basic struct.
+// The struct is made up of recursive 'left' and 'right' references to itself
+// for the branches (or 'NULL' if a leaf) and a char* for the data which, in
+// this case, will be a 64-character hash digest represented as a hexidecimal
+// string.
+
+struct Node {
+    struct Node *left;
+    struct Node *right;
+    char *sha256_digest;
+}; 
+
+typedef struct Node Node;
+
+// Records are pulled out of the data one at a time with a RecordCursor, which
+// is just the data, its length and the position of the next unread byte. The
+// tree used to be built by running strtok()
+// (https://man7.org/linux/man-pages/man3/strtok.3.html) over a copy of the
+// file, but strtok() writes a '\0' over every delimiter it finds and the mapped
+// file is read-only. next_record() follows the same rules strtok() did, though:
+// runs of newlines are skipped, so blank lines never become leaves.
+//
+// Because a cursor can be started at any byte offset, a subtree can be rebuilt
+// from the records underneath it without scanning the file from the beginning
+// (see compute_subtree()).
+
+struct RecordCursor {
+    const char *data;
+    long data_len;
+    long pos;
+};
+
+typedef struct RecordCursor RecordCursor;
+
+// Building every layer of the tree and keeping all of them costs roughly two
+// Nodes (and two digest strings) for every leaf. Keeping only the root is
+// cheap but then there's nothing left to produce a proof or diff from without
+// building the whole tree again. A RetentionPolicy sits somewhere in between:
+//
+//      'top_levels'    keep the top K levels of the tree (the root is level
+//                      'height - 1', the leaves are level 0)
+//      'level_stride'  keep every Mth level above the leaves (levels M, 2M,
+//                      3M, ...)
+//
+// A level is kept if either rule asks for it and the root is always kept. If
+// both are 0 every level is kept, which is how the tree has always been built.
+// Levels below the lowest kept level (the 'frontier') are recomputed from the
+// mapped data file when they're needed and levels dropped between two kept
+// levels are recomputed from the kept level beneath them.
+
+struct RetentionPolicy {
+    int top_levels;
+    int level_stride;
+};
+
+typedef struct RetentionPolicy RetentionPolicy;
+
+// Whenever a proof or diff reaches below the frontier, the whole subtree
+// underneath the Node it passed through is rebuilt from the data file and kept
+// in a small LRU (least recently used) cache, on the basis that the next query
+// is likely to land near the last one (neighbouring records in a diff, for
+// instance).
+//
+// Cached subtrees are rooted at the frontier or, if the frontier is more than
+// MAX_CACHED_SUBTREE_LEVELS levels above the leaves, at that level instead
+// (the MerkleTree's 'subtree_level'), so no Subtree ever holds more than
+// 2^17 digests (4MB). In that case the digests of every Node on the
+// 'subtree_level' are kept as well, as raw digests in 'subtree_roots' (one
+// for every 65,536 leaves), and the levels between the two are hashed from
+// them.
+//
+// A Subtree stores the digests for levels 0 to 'subtree_level - 1' underneath
+// the Node at 'root_index' on 'subtree_level', in a single block of memory,
+// lowest level first, as raw 32-byte SHA256 digests. Only the Nodes that
+// actually exist are stored, so a Subtree on the right-hand edge of the tree
+// can be much smaller than the rest, and 'level_offsets' holds where each
+// level starts (counted in digests). Subtrees are chained together in order of
+// use, most recent first, and when the cache is full the Subtree at the tail
+// is thrown away.
+
+#define MAX_CACHED_SUBTREE_LEVELS 16
+
+struct Subtree {
+    long root_index;
+    unsigned char *digests;
+    long level_offsets[MAX_CACHED_SUBTREE_LEVELS];
+    struct Subtree *prev;
+    struct Subtree *next;
+};
+
+typedef struct Subtree Subtree;
+
+struct SubtreeCache {
+    Subtree *head;
+    Subtree *tail;
+    int count;
+    int capacity;
+    long hits;
+    long misses;
+};
+
+typedef struct SubtreeCache SubtreeCache;
+
+// A MerkleTree ties the layers of the tree to the data they were built from.
+// 'levels' holds the Node pointer-chain for each kept level, or NULL where the
+// level has been dropped, and 'level_lens' holds the number of Nodes each
+// level has (or would have). A tree is never more than 64 levels high because
+// that would need more than 2^63 leaves.
+//
+// 'frontier_offsets' holds the byte offset in 'data' of the first record
+// underneath each Node on the frontier, so that a RecordCursor can be started
+// there to rebuild it. It is only needed (and only allocated) when the leaves
+// themselves haven't been kept. 'subtree_roots' and 'subtree_offsets' (the
+// same again for each Node on the 'subtree_level') are only allocated when the
+// 'subtree_level' is below the frontier (see build_frontier()).
+//
+// 'data_mapped' records whether 'data' is a mapping made by map_data_file(),
+// which free_tree() has to unmap, or memory that belongs to whoever called
+// build_tree() and has to stay put until the tree is freed.
+
+#define MAX_TREE_HEIGHT 64
+
+struct MerkleTree {
+    const char *data;
+    long data_len;
+    bool data_mapped;
+    long leaf_count;
+    int height;
+    int frontier;
+    int subtree_level;
+    RetentionPolicy policy;
+    long level_lens[MAX_TREE_HEIGHT];
+    Node **levels[MAX_TREE_HEIGHT];
+    long *frontier_offsets;
+    unsigned char *subtree_roots;
+    long *subtree_offsets;
+    SubtreeCache cache;
+};
+
+typedef struct MerkleTree MerkleTree;
+
+// A proof (or audit path) for a single record is the digest of its sibling at
+// every level from the leaves up to, but not including, the root, along with
+// which side of the concatenation the sibling goes (see get_proof() and
+// fold_proof()).
+
+struct ProofStep {
+    char sibling_digest[65];
+    bool sibling_is_left;
+};
+
+typedef struct ProofStep ProofStep;
+
+// Records that differ between two trees are collected into runs of
+// neighbouring records, so a block of changed data is reported once rather
+// than record by record (see diff_trees()). 'first' and 'last' are both
+// included in the run.
+
+struct DiffRange {
+    long first;
+    long last;
+};
+
+typedef struct DiffRange DiffRange;
+
+struct DiffList {
+    DiffRange *ranges;
+    long count;
+    long capacity;
+};
+
+typedef struct DiffList DiffList;
+
+// A DigestSet is the part of a tree that's stored so a copy of the data can be
+// verified later without the tree having to be built again (see
+// verify_data()). It holds the digests of every level from 'base_level' up to
+// the root, as raw 32-byte SHA256 digests rather than hex strings to keep the
+// file small. Each Node on the base level is the root of a 'block' of
+// 2^base_level records, and 'block_offsets' holds the byte offset in the data
+// of the first record in each block, so the blocks can be rehashed
+// independently of each other.
+
+struct DigestSet {
+    long leaf_count;
+    long data_len;
+    int height;
+    int base_level;
+    long level_lens[MAX_TREE_HEIGHT];
+    unsigned char *digests[MAX_TREE_HEIGHT];
+    long *block_offsets;
+};
+
+typedef struct DigestSet DigestSet;
+
+// VerifyResult describes how a verification went. The digest set has to hang
+// together before any blocks are checked ('digest_set_consistent'), and
+// 'extra_records' is set if every block matched but there were still records
+// left over afterwards. 'mismatches' holds the runs of records covered by the
+// blocks that failed.
+
+struct VerifyResult {
+    bool digest_set_consistent;
+    long block_count;
+    long blocks_checked;
+    long mismatched_blocks;
+    bool stopped_early;
+    bool extra_records;
+    DiffList mismatches;
+};
+
+typedef struct VerifyResult VerifyResult;
+
+// When 'print_progress' is true the tree-building functions print what they're
+// doing to stdout as they go. mtree turns it on; anything else using the
+// functions as a library is left with a quiet build.
+
+extern bool print_progress;
+
+Node* new_node(Node *left, Node *right, char *sha256_digest);
+char* map_data_file(const char *dict_file, long *data_len);
+unsigned char* sha256(const char *data, size_t data_len);
+char* hexdigest(const unsigned char *hash);
+void digest_to_hex(const unsigned char *hash, char *hex_digest);
+bool digest_from_hex(const char *hex_digest, unsigned char *hash);
+void sha256_hex(const char *data, size_t data_len, char *hex_digest);
+
+bool next_record(RecordCursor *cursor, const char **record, long *record_len);
+long get_word_count(const char* data, long data_len);
+Node** build_leaves(const char* data, long data_len, long word_count);
+
+bool is_level_retained(RetentionPolicy policy, int level, int height);
+Node** build_next_layer(Node **previous_layer, long previous_layer_len, long *new_layer_len);
+void free_layer(Node **layer, long layer_len);
+Node* build_merkle_tree(MerkleTree *tree, int level);
+bool compute_subtree(MerkleTree *tree, RecordCursor *cursor, int level, long index, Subtree *subtree, char *hex_digest);
+Node** build_frontier(MerkleTree *tree);
+void set_tree_shape(MerkleTree *tree, long leaf_count);
+MerkleTree* build_tree(const char *data, long data_len, RetentionPolicy policy, int cache_capacity);
+MerkleTree* build_tree_from_file(const char *data_file, RetentionPolicy policy, int cache_capacity);
+void free_tree(MerkleTree *tree);
+
+unsigned char* subtree_digest_slot(MerkleTree *tree, Subtree *subtree, int level, long index);
+Subtree* rebuild_subtree(MerkleTree *tree, long root_index);
+Subtree* fetch_subtree(MerkleTree *tree, long root_index);
+long record_offset(MerkleTree *tree, long record);
+bool get_digest(MerkleTree *tree, int level, long index, char *hex_digest);
+const char* root_digest(MerkleTree *tree);
+
+int get_proof(MerkleTree *tree, long record, char *leaf_digest, ProofStep *steps);
+void fold_proof(const char *leaf_digest, const ProofStep *steps, int step_count, char *hex_digest);
+bool diff_trees(MerkleTree *tree_a, MerkleTree *tree_b, DiffList *diff);
+void add_diff_range(DiffList *diff, long first, long last);
+void free_diff(DiffList *diff);
+
+DigestSet* make_digest_set(MerkleTree *tree, int base_level);
+bool write_digest_set(DigestSet *set, const char *digest_file);
+DigestSet* read_digest_set(const char *digest_file);
+void free_digest_set(DigestSet *set);
+bool check_digest_set(DigestSet *set, int thread_count);
+bool verify_data(const char *data, long data_len, DigestSet *set, int thread_count, long max_mismatches, VerifyResult *result);
+
+#endif
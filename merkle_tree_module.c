@@ -0,0 +1,583 @@
+// A CPython extension module, 'cmerkle', that builds Merkle Trees with the
+// functions in merkle_tree.c rather than in Python.
+//
+// merkle_tree.py is a reference implementation and it builds a new Python
+// object and a new hashlib object for every Node, which is fine for six words
+// but orders of magnitude slower than the C version for the 466,550 in the
+// test data. The hashing scheme is identical (each record is hashed, then the
+// 64-character hex digests of each pair are concatenated and hashed, with the
+// last digest of an odd layer duplicated) so both produce the same root for the
+// same records.
+//
+// The records can come from:
+//
+//      - a path (str or os.PathLike), which is memory-mapped
+//        exactly as mtree does it (see map_data_file())
+//      - any object supporting the buffer protocol (bytes, bytearray,
+//        memoryview, mmap.mmap, ...), which is used where it is rather than
+//        copied and must hold a contiguous block of newline-separated records
+//
+// and the module provides:
+//
+//      cmerkle.root(source)            the root digest, without keeping a tree
+//      cmerkle.Tree(source, ...)       a tree handle for proofs and diffs
+//      cmerkle.fold_proof(leaf, proof) the root a proof leads to
+//
+// The GIL is released while the tree is being built and while digests are
+// being recomputed, so other Python threads can carry on in the meantime. A
+// Tree can be shared between threads: each one has its own lock, because
+// proofs and diffs may rebuild subtrees into its cache (see fetch_subtree()).
+//
+// Build it with:
+//
+//      python3 setup.py build_ext --inplace
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "merkle_tree.h"
+
+#define DEFAULT_CACHE_CAPACITY 16
+
+// A Tree object owns the MerkleTree and whatever its data lives in. If the
+// data came from a buffer, the Py_buffer is held (which keeps the exporting
+// object alive and stops a bytearray, for instance, from being resized) until
+// the Tree is deallocated.
+
+typedef struct {
+    PyObject_HEAD
+    MerkleTree *tree;
+    Py_buffer view;
+    bool has_view;
+    PyThread_type_lock lock;
+} TreeObject;
+
+static PyTypeObject TreeType;
+
+// build_from_source() builds a MerkleTree from either a path or a buffer. On
+// success the tree is returned and, if a buffer was used, 'view' is filled in
+// and '*has_view' set; the caller must release it once the tree has been
+// freed. On failure a Python exception is set and NULL is returned.
+
+static MerkleTree* build_from_source(PyObject *source, RetentionPolicy policy, int cache_capacity, Py_buffer *view, bool *has_view) {
+
+    MerkleTree *tree;
+    *has_view = false;
+
+    if (PyUnicode_Check(source) || !PyObject_CheckBuffer(source)) {
+
+        // Not a buffer, so it had better be a path. PyUnicode_FSConverter()
+        // accepts str and os.PathLike and encodes it for the filesystem. Note
+        // that bytes are always treated as records, not as a path.
+
+        PyObject *path_bytes;
+        if (!PyUnicode_FSConverter(source, &path_bytes)) {
+            return NULL;
+        }
+
+        const char *path = PyBytes_AS_STRING(path_bytes);
+        int build_errno;
+
+        Py_BEGIN_ALLOW_THREADS
+        tree = build_tree_from_file(path, policy, cache_capacity);
+        build_errno = errno;
+        Py_END_ALLOW_THREADS
+
+        if (tree == NULL) {
+            if (build_errno == ENODATA) {
+                PyErr_Format(PyExc_ValueError, "no records found in %s", path);
+            }
+            else {
+                errno = build_errno;
+                PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, source);
+            }
+        }
+
+        Py_DECREF(path_bytes);
+        return tree;
+    }
+
+    if (PyObject_GetBuffer(source, view, PyBUF_SIMPLE) == -1) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    tree = build_tree(view->buf, view->len, policy, cache_capacity);
+    Py_END_ALLOW_THREADS
+
+    if (tree == NULL) {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_ValueError, "no records found in buffer");
+        return NULL;
+    }
+
+    *has_view = true;
+    return tree;
+}
+
+// parse_policy() checks the retention keyword arguments given to Tree().
+
+static int parse_policy(int top_levels, int level_stride, int cache_capacity, RetentionPolicy *policy) {
+
+    if (top_levels < 0 || level_stride < 0 || cache_capacity < 1) {
+        PyErr_SetString(PyExc_ValueError, "top_levels and level_stride must be >= 0 and cache_size >= 1");
+        return -1;
+    }
+
+    policy->top_levels = top_levels;
+    policy->level_stride = level_stride;
+
+    return 0;
+}
+
+// cmerkle.root(source) builds only as much of the tree as it needs to get the
+// root digest. Keeping just the top level means the root is hashed straight
+// from the records (see build_frontier()) and no Nodes are built at all.
+
+static PyObject* cmerkle_root(PyObject *module, PyObject *args) {
+
+    PyObject *source;
+    if (!PyArg_ParseTuple(args, "O:root", &source)) {
+        return NULL;
+    }
+
+    RetentionPolicy policy = { 1, 0 };
+    Py_buffer view;
+    bool has_view;
+
+    MerkleTree *tree = build_from_source(source, policy, 1, &view, &has_view);
+    if (tree == NULL) {
+        return NULL;
+    }
+
+    PyObject *root = PyUnicode_FromString(root_digest(tree));
+
+    free_tree(tree);
+    if (has_view) {
+        PyBuffer_Release(&view);
+    }
+
+    return root;
+}
+
+// cmerkle.fold_proof(leaf_digest, proof) hashes a record's digest up through a
+// proof, as returned by Tree.proof(), and returns the digest it arrives at. If
+// that matches the root the record belongs to the tree.
+
+static PyObject* cmerkle_fold_proof(PyObject *module, PyObject *args) {
+
+    const char *leaf_digest;
+    Py_ssize_t leaf_digest_len;
+    PyObject *proof;
+
+    if (!PyArg_ParseTuple(args, "s#O:fold_proof", &leaf_digest, &leaf_digest_len, &proof)) {
+        return NULL;
+    }
+
+    if (leaf_digest_len != 64) {
+        PyErr_SetString(PyExc_ValueError, "leaf_digest must be a 64-character hex digest");
+        return NULL;
+    }
+
+    PyObject *steps_seq = PySequence_Fast(proof, "proof must be a sequence of (digest, sibling_is_left) pairs");
+    if (steps_seq == NULL) {
+        return NULL;
+    }
+
+    const Py_ssize_t step_count = PySequence_Fast_GET_SIZE(steps_seq);
+    if (step_count >= MAX_TREE_HEIGHT) {
+        Py_DECREF(steps_seq);
+        PyErr_SetString(PyExc_ValueError, "proof has too many steps");
+        return NULL;
+    }
+
+    ProofStep steps[MAX_TREE_HEIGHT];
+
+    for (Py_ssize_t i = 0; i < step_count; i++) {
+
+        const char *sibling_digest;
+        Py_ssize_t sibling_digest_len;
+        int sibling_is_left;
+
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(steps_seq, i), "s#p", &sibling_digest, &sibling_digest_len, &sibling_is_left)) {
+            Py_DECREF(steps_seq);
+            return NULL;
+        }
+
+        if (sibling_digest_len != 64) {
+            Py_DECREF(steps_seq);
+            PyErr_SetString(PyExc_ValueError, "proof digests must be 64-character hex digests");
+            return NULL;
+        }
+
+        memcpy(steps[i].sibling_digest, sibling_digest, 64);
+        steps[i].sibling_digest[64] = '\0';
+        steps[i].sibling_is_left = sibling_is_left;
+    }
+
+    Py_DECREF(steps_seq);
+
+    char folded_digest[65];
+    char leaf[65];
+    memcpy(leaf, leaf_digest, 64);
+    leaf[64] = '\0';
+
+    fold_proof(leaf, steps, (int)step_count, folded_digest);
+
+    return PyUnicode_FromString(folded_digest);
+}
+
+// Tree(source, top_levels=0, level_stride=0, cache_size=16) builds a tree and
+// keeps it. The keyword arguments are the RetentionPolicy and the number of
+// rebuilt subtrees to cache, exactly as mtree's -k, -m and -l options.
+
+static PyObject* Tree_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+
+    static char *keywords[] = { "source", "top_levels", "level_stride", "cache_size", NULL };
+
+    PyObject *source;
+    int top_levels = 0;
+    int level_stride = 0;
+    int cache_capacity = DEFAULT_CACHE_CAPACITY;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$iii:Tree", keywords, &source, &top_levels, &level_stride, &cache_capacity)) {
+        return NULL;
+    }
+
+    RetentionPolicy policy;
+    if (parse_policy(top_levels, level_stride, cache_capacity, &policy) == -1) {
+        return NULL;
+    }
+
+    TreeObject *self = (TreeObject *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+
+    self->lock = PyThread_allocate_lock();
+    if (self->lock == NULL) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    self->tree = build_from_source(source, policy, cache_capacity, &self->view, &self->has_view);
+    if (self->tree == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject *)self;
+}
+
+static void Tree_dealloc(TreeObject *self) {
+
+    if (self->tree != NULL) {
+        free_tree(self->tree);
+    }
+
+    if (self->has_view) {
+        PyBuffer_Release(&self->view);
+    }
+
+    if (self->lock != NULL) {
+        PyThread_free_lock(self->lock);
+    }
+
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+// lock_tree() takes a Tree's lock without holding on to the GIL while it
+// waits, which could otherwise deadlock against a thread that holds the lock
+// and wants the GIL back.
+
+static void lock_tree(TreeObject *self) {
+
+    if (PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+        return;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    Py_END_ALLOW_THREADS
+}
+
+// raise_tree_error() turns the 'errno' left by a digest, proof or diff that
+// couldn't be worked out into a Python exception: MemoryError if a subtree
+// couldn't be allocated and RuntimeError if the data has changed since the
+// tree was built (see rebuild_subtree()).
+
+static PyObject* raise_tree_error(int error) {
+
+    if (error == ENOMEM) {
+        return PyErr_NoMemory();
+    }
+
+    if (error == ESTALE) {
+        PyErr_SetString(PyExc_RuntimeError, "data has changed since the tree was built");
+        return NULL;
+    }
+
+    errno = error;
+    return PyErr_SetFromErrno(PyExc_OSError);
+}
+
+// Tree.digest(level, index) returns the digest of any Node in the tree,
+// recomputing it if its level wasn't kept.
+
+static PyObject* Tree_digest(TreeObject *self, PyObject *args) {
+
+    int level;
+    long index;
+
+    if (!PyArg_ParseTuple(args, "il:digest", &level, &index)) {
+        return NULL;
+    }
+
+    MerkleTree *tree = self->tree;
+
+    if (level < 0 || level >= tree->height || index < 0 || index >= tree->level_lens[level]) {
+        PyErr_SetString(PyExc_IndexError, "no such node in tree");
+        return NULL;
+    }
+
+    char hex_digest[65];
+    bool found;
+    int digest_errno;
+
+    lock_tree(self);
+    Py_BEGIN_ALLOW_THREADS
+    found = get_digest(tree, level, index, hex_digest);
+    digest_errno = errno;
+    Py_END_ALLOW_THREADS
+    PyThread_release_lock(self->lock);
+
+    if (!found) {
+        return raise_tree_error(digest_errno);
+    }
+
+    return PyUnicode_FromString(hex_digest);
+}
+
+// Tree.proof(record) returns the proof for a record as a list of
+// (sibling_digest, sibling_is_left) pairs, from the leaves upwards (see
+// get_proof()). The record's own digest is Tree.digest(0, record).
+
+static PyObject* Tree_proof(TreeObject *self, PyObject *args) {
+
+    long record;
+
+    if (!PyArg_ParseTuple(args, "l:proof", &record)) {
+        return NULL;
+    }
+
+    if (record < 0 || record >= self->tree->leaf_count) {
+        PyErr_SetString(PyExc_IndexError, "record out of range");
+        return NULL;
+    }
+
+    char leaf_digest[65];
+    ProofStep steps[MAX_TREE_HEIGHT];
+    int step_count;
+    int proof_errno;
+
+    lock_tree(self);
+    Py_BEGIN_ALLOW_THREADS
+    step_count = get_proof(self->tree, record, leaf_digest, steps);
+    proof_errno = errno;
+    Py_END_ALLOW_THREADS
+    PyThread_release_lock(self->lock);
+
+    if (step_count == -1) {
+        return raise_tree_error(proof_errno);
+    }
+
+    PyObject *proof = PyList_New(step_count);
+    if (proof == NULL) {
+        return NULL;
+    }
+
+    for (int i = 0; i < step_count; i++) {
+
+        PyObject *step = Py_BuildValue("(sO)", steps[i].sibling_digest, steps[i].sibling_is_left ? Py_True : Py_False);
+        if (step == NULL) {
+            Py_DECREF(proof);
+            return NULL;
+        }
+
+        PyList_SET_ITEM(proof, i, step);
+    }
+
+    return proof;
+}
+
+// Tree.diff(other) returns the runs of records that differ between two trees
+// as a list of (first, last) pairs, both inclusive (see diff_trees()). Both
+// trees are locked, in a fixed order so two threads diffing the same pair the
+// other way round can't deadlock.
+
+static PyObject* Tree_diff(TreeObject *self, PyObject *args) {
+
+    TreeObject *other;
+
+    if (!PyArg_ParseTuple(args, "O!:diff", &TreeType, &other)) {
+        return NULL;
+    }
+
+    TreeObject *first = self < other ? self : other;
+    TreeObject *second = self < other ? other : self;
+
+    DiffList diff = { NULL, 0, 0 };
+    bool diffed;
+    int diff_errno;
+
+    lock_tree(first);
+    if (second != first) {
+        lock_tree(second);
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    diffed = diff_trees(self->tree, other->tree, &diff);
+    diff_errno = errno;
+    Py_END_ALLOW_THREADS
+
+    if (second != first) {
+        PyThread_release_lock(second->lock);
+    }
+    PyThread_release_lock(first->lock);
+
+    if (!diffed) {
+
+        free_diff(&diff);
+
+        if (diff_errno != EINVAL) {
+            return raise_tree_error(diff_errno);
+        }
+
+        PyErr_Format(PyExc_ValueError, "record counts differ (%ld vs %ld)", self->tree->leaf_count, other->tree->leaf_count);
+        return NULL;
+    }
+
+    PyObject *ranges = PyList_New(diff.count);
+
+    for (long i = 0; ranges != NULL && i < diff.count; i++) {
+
+        PyObject *range = Py_BuildValue("(ll)", diff.ranges[i].first, diff.ranges[i].last);
+        if (range == NULL) {
+            Py_CLEAR(ranges);
+            break;
+        }
+
+        PyList_SET_ITEM(ranges, i, range);
+    }
+
+    free_diff(&diff);
+
+    return ranges;
+}
+
+static PyObject* Tree_get_root(TreeObject *self, void *closure) {
+    return PyUnicode_FromString(root_digest(self->tree));
+}
+
+static PyObject* Tree_get_height(TreeObject *self, void *closure) {
+    return PyLong_FromLong(self->tree->height);
+}
+
+static PyObject* Tree_get_retained_levels(TreeObject *self, void *closure) {
+
+    PyObject *levels = PyList_New(0);
+
+    for (int level = 0; levels != NULL && level < self->tree->height; level++) {
+
+        if (self->tree->levels[level] == NULL) {
+            continue;
+        }
+
+        PyObject *level_obj = PyLong_FromLong(level);
+        if (level_obj == NULL || PyList_Append(levels, level_obj) == -1) {
+            Py_XDECREF(level_obj);
+            Py_CLEAR(levels);
+            break;
+        }
+        Py_DECREF(level_obj);
+    }
+
+    return levels;
+}
+
+static Py_ssize_t Tree_len(TreeObject *self) {
+    return self->tree->leaf_count;
+}
+
+static PyMethodDef Tree_methods[] = {
+    { "digest", (PyCFunction)Tree_digest, METH_VARARGS, "digest(level, index) -> hex digest of a node (level 0 is the leaves)" },
+    { "proof", (PyCFunction)Tree_proof, METH_VARARGS, "proof(record) -> list of (sibling_digest, sibling_is_left) pairs, leaves first" },
+    { "diff", (PyCFunction)Tree_diff, METH_VARARGS, "diff(other) -> list of (first, last) runs of records that differ" },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef Tree_getset[] = {
+    { "root", (getter)Tree_get_root, NULL, "root digest of the tree", NULL },
+    { "height", (getter)Tree_get_height, NULL, "number of levels in the tree, leaves included", NULL },
+    { "retained_levels", (getter)Tree_get_retained_levels, NULL, "levels kept in memory under the retention policy", NULL },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+static PySequenceMethods Tree_as_sequence = {
+    .sq_length = (lenfunc)Tree_len,
+};
+
+static PyTypeObject TreeType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "cmerkle.Tree",
+    .tp_doc = "Tree(source, *, top_levels=0, level_stride=0, cache_size=16)\n\n"
+              "A Merkle Tree built from newline-separated records in a file (path)\n"
+              "or a buffer (bytes, bytearray, memoryview, mmap, ...).",
+    .tp_basicsize = sizeof(TreeObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = Tree_new,
+    .tp_dealloc = (destructor)Tree_dealloc,
+    .tp_methods = Tree_methods,
+    .tp_getset = Tree_getset,
+    .tp_as_sequence = &Tree_as_sequence,
+};
+
+static PyMethodDef cmerkle_methods[] = {
+    { "root", cmerkle_root, METH_VARARGS, "root(source) -> root hex digest of the records in a file (path) or buffer" },
+    { "fold_proof", cmerkle_fold_proof, METH_VARARGS, "fold_proof(leaf_digest, proof) -> the root digest the proof leads to" },
+    { NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef cmerkle_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "cmerkle",
+    .m_doc = "Merkle Trees built by the C engine behind mtree, hashed the same way as merkle_tree.py.",
+    .m_size = -1,
+    .m_methods = cmerkle_methods,
+};
+
+PyMODINIT_FUNC PyInit_cmerkle(void) {
+
+    if (PyType_Ready(&TreeType) < 0) {
+        return NULL;
+    }
+
+    PyObject *module = PyModule_Create(&cmerkle_module);
+    if (module == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF(&TreeType);
+    if (PyModule_AddObject(module, "Tree", (PyObject *)&TreeType) < 0) {
+        Py_DECREF(&TreeType);
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    return module;
+}
@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// mtree is the command-line front end to the Merkle Tree functions in
+// merkle_tree.c. It needs to be compiled with merkle_tree.c, the cakelog
+// library and the OpenSSL libraries (see the Makefile).
+
+#include "cakelog.h"
+#include "merkle_tree.h"
+
+// tree_error() describes the 'errno' left by a proof, diff or digest that
+// couldn't be worked out. ESTALE is how the tree reports that the data file
+// has changed since it was built (see rebuild_subtree()).
+
+const char* tree_error(int error) {
+
+    if (error == ESTALE) {
+        return "the data file has changed since the tree was built";
+    }
+
+    return strerror(error);
+}
+
+// print_proof() prints the proof for a single record (see get_proof()), one
+// level per line, and then folds it back up to the root to check it.
+
+void print_proof(MerkleTree *tree, long record) {
+
+    char leaf_digest[65];
+    char folded_digest[65];
+    ProofStep steps[MAX_TREE_HEIGHT];
+
+    const int step_count = get_proof(tree, record, leaf_digest, steps);
+
+    if (step_count == -1 && errno == ERANGE) {
+        fprintf(stderr, "record %ld is out of range (the tree has %ld records)\n", record, tree->leaf_count);
+        return;
+    }
+
+    if (step_count == -1) {
+        fprintf(stderr, "unable to work out the proof for record %ld: %s\n", record, tree_error(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("proof for record %ld (leaf digest %s):\n", record, leaf_digest);
+
+    for (int level = 0; level < step_count; level++) {
+        printf("  level %2d  %s  %s\n", level, steps[level].sibling_is_left ? "left " : "right", steps[level].sibling_digest);
+    }
+
+    fold_proof(leaf_digest, steps, step_count, folded_digest);
+
+    printf("proof %s the root digest\n", strcmp(folded_digest, root_digest(tree)) == 0 ? "reproduces" : "does NOT reproduce");
+}
+
+// print_diff() prints the runs of records that differ between two trees (see
+// diff_trees()).
+
+void print_diff(MerkleTree *tree_a, MerkleTree *tree_b) {
+
+    DiffList diff = { NULL, 0, 0 };
+
+    if (!diff_trees(tree_a, tree_b, &diff)) {
+
+        if (errno != EINVAL) {
+            fprintf(stderr, "unable to compare the trees: %s\n", tree_error(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        printf("record counts differ (%ld vs %ld)\n", tree_a->leaf_count, tree_b->leaf_count);
+        free_diff(&diff);
+        return;
+    }
+
+    printf("differences:\n");
+
+    for (long i = 0; i < diff.count; i++) {
+        if (diff.ranges[i].first == diff.ranges[i].last) {
+            printf("  record %ld differs\n", diff.ranges[i].first);
+        }
+        else {
+            printf("  records %ld-%ld differ\n", diff.ranges[i].first, diff.ranges[i].last);
+        }
+    }
+
+    if (diff.count == 0) {
+        printf("  none\n");
+    }
+
+    free_diff(&diff);
+}
+
+// load_tree() builds a tree from a data file for mtree, giving up with an
+// error message if it can't.
+
+MerkleTree* load_tree(const char *data_file, RetentionPolicy policy, int cache_capacity) {
+
+    printf("reading file %s\n", data_file);
+
+    MerkleTree *tree = build_tree_from_file(data_file, policy, cache_capacity);
+
+    if (tree == NULL) {
+        fprintf(stderr, "unable to build tree from %s: %s\n", data_file, errno == ENODATA ? "no words found" : strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return tree;
+}
+
+// write_digests() saves the levels of the tree from 'base_level' up to the
+// root to 'digest_file', so the data can be verified against them later (see
+// verify_file()).
+
+void write_digests(MerkleTree *tree, int base_level, const char *digest_file) {
+
+    DigestSet *set = make_digest_set(tree, base_level);
+
+    if (set == NULL) {
+        fprintf(stderr, "unable to collect the digests to write: %s\n", tree_error(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (!write_digest_set(set, digest_file)) {
+        fprintf(stderr, "unable to write digests to %s: %s\n", digest_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("wrote digests for levels %d to %d (%ld blocks of %ld records) to %s\n\n", set->base_level, set->height - 1, set->level_lens[set->base_level], 1L << set->base_level, digest_file);
+
+    free_digest_set(set);
+}
+
+// verify_file() checks a data file against a digest set written by
+// write_digests() without building a tree (see verify_data()) and prints the
+// runs of records that don't match. It returns the exit status for mtree: 0
+// if everything matched, 1 if it didn't.
+
+int verify_file(const char *data_file, const char *digest_file, int thread_count, long max_mismatches) {
+
+    DigestSet *set = read_digest_set(digest_file);
+
+    if (set == NULL) {
+        fprintf(stderr, "unable to read digests from %s: %s\n", digest_file, errno == EINVAL ? "not a valid digest set" : strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // An empty file can't be mapped but it's a perfectly good (if very
+    // broken) replica, so it's verified as no data at all.
+
+    long data_len = 0;
+    char *data = map_data_file(data_file, &data_len);
+
+    if (data == NULL && errno != ENODATA) {
+        fprintf(stderr, "unable to read %s: %s\n", data_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("verifying %s against %s (%ld records in %ld blocks, %d threads)\n", data_file, digest_file, set->leaf_count, set->level_lens[set->base_level], thread_count);
+
+    if (data_len != set->data_len) {
+        printf("file is %ld bytes, expected %ld\n", data_len, set->data_len);
+    }
+
+    struct timespec start, finish;
+    VerifyResult result;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const bool verified = verify_data(data == NULL ? "" : data, data_len, set, thread_count, max_mismatches, &result);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    const double elapsed_ms = ((finish.tv_sec - start.tv_sec) * 1000.0) + ((finish.tv_nsec - start.tv_nsec) / 1000000.0);
+
+    printf("\n");
+
+    if (!result.digest_set_consistent) {
+        printf("digest set %s is corrupt: its levels don't lead back to its root\n", digest_file);
+    }
+
+    for (long i = 0; i < result.mismatches.count; i++) {
+        printf("mismatch: records %ld-%ld\n", result.mismatches.ranges[i].first, result.mismatches.ranges[i].last);
+    }
+
+    if (result.extra_records) {
+        printf("mismatch: extra records after record %ld\n", set->leaf_count - 1);
+    }
+
+    if (result.stopped_early) {
+        printf("stopped after %ld mismatched blocks\n", result.mismatched_blocks);
+    }
+
+    printf("\n");
+    printf("================================================================================\n");
+    printf("Verification %s: checked %ld of %ld blocks in %.3f ms\n", verified ? "PASSED" : "FAILED", result.blocks_checked, result.block_count, elapsed_ms);
+    printf("================================================================================\n");
+
+    free_diff(&result.mismatches);
+    free_digest_set(set);
+
+    if (data != NULL) {
+        munmap(data, data_len);
+    }
+
+    return verified ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// The program uses the cakelog logger
+// (https://github.com/chris-j-akers/cakelog)) which outputs timestamped
+// information to a log file, but this is optional as logging slows the program
+// down, especially if flush is forced.
+//
+// Usage (assuming the executable is called 'mtree') is:
+//
+//      mtree [-d|-f] [-k levels] [-m stride] [-l subtrees] [-p record]
+//            [-c other_datafile] [-w digestfile [-b level]] <datafile>
+//
+//      mtree [-d|-f] -v digestfile [-j threads] [-n mismatches] <datafile>
+//
+// Where <datafile> is the name of an input file that contains a list of words
+// on each line, -d is a request to trace output to a file, and -f is to trace
+// output to a file but also force Cakelog to flush the file each time it's
+// written to (can add considerable processing time).
+//
+// By default every level of the tree is kept. -k keeps only the top 'levels'
+// levels and -m keeps every 'stride'th level above the leaves (see
+// RetentionPolicy). -l sets how many rebuilt subtrees are cached for proofs
+// and diffs (the default is 16).
+//
+// -p prints the proof for the record at index 'record' (counting from 0) and
+// -c builds a second tree from 'other_datafile', with the same retention
+// policy, and prints the records that differ between the two.
+//
+// -w saves the digests of every level of the tree from level 'level' (10 by
+// default, so blocks of 1024 records) up to the root in 'digestfile'. -v
+// verifies <datafile> against a 'digestfile' saved that way, without building
+// a tree, using 'threads' threads (by default, one per CPU). It stops after
+// 'mismatches' blocks have failed (1 by default, 0 to check every block) and
+// exits with a status of 1 if anything didn't match.
+//
+// The datafile should be a file of words or text separated by a newline
+// character. There are some examples in the ./test-data folder of this repo.
+
+#define DEFAULT_CACHE_CAPACITY 16
+#define DEFAULT_BASE_LEVEL 10
+
+void print_usage(const char *executable_name) {
+    printf("Usage: %s [-d|-f] [-k levels] [-m stride] [-l subtrees] [-p record] [-c other_datafile] [-w digestfile [-b level]] <datafile>\n", executable_name);
+    printf("       %s [-d|-f] -v digestfile [-j threads] [-n mismatches] <datafile>\n", executable_name);
+}
+
+// parse_count() reads the numeric argument of an option, which must be a
+// whole number from 0 to 'max' (so it fits the field it is stored in).
+
+long parse_count(const char *arg, long max, const char *executable_name) {
+
+    char *end;
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || errno == ERANGE || value < 0 || value > max) {
+        printf("Invalid number: %s\n", arg);
+        print_usage(executable_name);
+        exit(EXIT_FAILURE);
+    }
+
+    return value;
+}
+
+int main(int argc, char *argv[]) {
+
+    // Borrow the Cakelogger timstamp function
+    char *timestamp_start = get_timestamp();
+
+    int opt;
+    RetentionPolicy policy = { 0, 0 };
+    int cache_capacity = DEFAULT_CACHE_CAPACITY;
+    long proof_record = -1;
+    const char *compare_file = NULL;
+    const char *digest_file = NULL;
+    const char *verify_digest_file = NULL;
+    int base_level = DEFAULT_BASE_LEVEL;
+    int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    long max_mismatches = 1;
+
+    while ((opt = getopt(argc, argv, "dfk:m:l:p:c:w:b:v:j:n:")) != -1) {
+        if ((unsigned char)opt == 'd') {
+            /* debug without flush */
+            cakelog_initialise(argv[0], false);
+        }
+        else if ((unsigned char)opt == 'f') {
+            /* debug with flush */
+            cakelog_initialise(argv[0], true);
+        }
+        else if ((unsigned char)opt == 'k') {
+            policy.top_levels = parse_count(optarg, INT_MAX, argv[0]);
+        }
+        else if ((unsigned char)opt == 'm') {
+            policy.level_stride = parse_count(optarg, INT_MAX, argv[0]);
+        }
+        else if ((unsigned char)opt == 'l') {
+            cache_capacity = parse_count(optarg, INT_MAX, argv[0]);
+        }
+        else if ((unsigned char)opt == 'p') {
+            proof_record = parse_count(optarg, LONG_MAX, argv[0]);
+        }
+        else if ((unsigned char)opt == 'c') {
+            compare_file = optarg;
+        }
+        else if ((unsigned char)opt == 'w') {
+            digest_file = optarg;
+        }
+        else if ((unsigned char)opt == 'b') {
+            base_level = parse_count(optarg, MAX_TREE_HEIGHT - 1, argv[0]);
+        }
+        else if ((unsigned char)opt == 'v') {
+            verify_digest_file = optarg;
+        }
+        else if ((unsigned char)opt == 'j') {
+            thread_count = parse_count(optarg, INT_MAX, argv[0]);
+        }
+        else if ((unsigned char)opt == 'n') {
+            max_mismatches = parse_count(optarg, LONG_MAX, argv[0]);
+        }
+        else {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+	if (optind >= argc) {
+		printf("Missing filename\n");
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+    if (verify_digest_file != NULL) {
+        const int status = verify_file(argv[optind], verify_digest_file, thread_count < 1 ? 1 : thread_count, max_mismatches);
+        free(timestamp_start);
+        cakelog_stop();
+        return status;
+    }
+
+    print_progress = true;
+
+    MerkleTree *tree = load_tree(argv[optind], policy, cache_capacity);
+
+    char *timestamp_stop = get_timestamp();
+
+    printf("\n");
+    printf("================================================================================\n");
+    printf("Root digest is: %s\n", root_digest(tree));
+    printf("================================================================================\n");
+    printf("\n");
+
+    if (proof_record != -1) {
+        print_proof(tree, proof_record);
+        printf("\n");
+    }
+
+    if (digest_file != NULL) {
+        write_digests(tree, base_level, digest_file);
+    }
+
+    if (compare_file != NULL) {
+
+        MerkleTree *other_tree = load_tree(compare_file, policy, cache_capacity);
+
+        printf("\n");
+        print_diff(tree, other_tree);
+        printf("\n");
+
+        free_tree(other_tree);
+    }
+
+    if (tree->frontier > 0 && (tree->cache.hits > 0 || tree->cache.misses > 0)) {
+        printf("subtree cache: %ld hits, %ld rebuilds\n\n", tree->cache.hits, tree->cache.misses);
+    }
+
+    // How long did it take?
+
+    printf("start:\t%s\n", timestamp_start);
+    printf("finish:\t%s\n", timestamp_stop);
+
+    free(timestamp_start);
+    free(timestamp_stop);
+
+    free_tree(tree);
+
+    cakelog_stop();
+
+}
@@ -0,0 +1,510 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// mtree_bench is a load generator for mtreed. It opens a number of
+// connections to the daemon, each on its own thread, and has each of them
+// send requests, one at a time, as fast as the daemon will answer them. It
+// times every request and, at the end, reports how many requests a second
+// the daemon managed and the 50th and 99th percentile (p50 and p99) latency,
+// overall and for each kind of request.
+//
+// It only needs mtree_protocol.c (see the Makefile).
+
+#include "mtree_protocol.h"
+
+// Usage (assuming the executable is called 'mtree_bench') is:
+//
+//      mtree_bench [-c connections] [-n requests | -t seconds] [-o ops]
+//                  [-b batch] -s <socket>
+//
+// Where <socket> is the socket mtreed is listening on. -c sets the number of
+// connections (the default is 4) and each one sends -n requests (the default
+// is 10000) or, with -t, keeps sending them for that many seconds.
+//
+// -o is a comma separated list of the requests to send, picked at random for
+// each request, from root, leaf, proof, range, diff and update (the default is
+// root,leaf,proof,range). A range request covers up to 1024 records, a diff
+// request compares up to 64 Nodes against zeroed digests and an update
+// request replaces -b records (the default is 16) with new, random ones.
+
+#define OP_COUNT 6
+
+const char *op_names[OP_COUNT] = { "root", "leaf", "proof", "range", "diff", "update" };
+
+// A Sample is the time taken by one request, in nanoseconds, and which kind of
+// request it was.
+
+struct Sample {
+    uint64_t nanoseconds;
+    int op;
+};
+
+typedef struct Sample Sample;
+
+// Each connection's thread has a Connection to itself, holding its settings,
+// its own random number state and the samples it has taken.
+
+struct Connection {
+    const char *socket_path;
+    int ops[OP_COUNT];
+    int op_count;
+    long request_limit;
+    double seconds;
+    int batch_size;
+    uint64_t random_state;
+
+    int64_t leaf_count;
+    int height;
+
+    Sample *samples;
+    long sample_count;
+    long sample_capacity;
+    long errors;
+    uint64_t last_version;
+};
+
+typedef struct Connection Connection;
+
+uint64_t now_nanoseconds(void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+// next_random() is xorshift64 (https://en.wikipedia.org/wiki/Xorshift), which
+// is plenty for picking records and keeps each thread away from rand()'s
+// shared state.
+
+uint64_t next_random(uint64_t *state) {
+
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+int connect_to_daemon(const char *socket_path) {
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "socket path is too long: %s\n", socket_path);
+        exit(EXIT_FAILURE);
+    }
+
+    strcpy(address.sun_path, socket_path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket()");
+        exit(EXIT_FAILURE);
+    }
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        perror("connect()");
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+// build_request() fills 'request' with a random request of the kind 'op'.
+
+void build_request(Connection *connection, int op, Message *request) {
+
+    const int64_t leaf_count = connection->leaf_count;
+
+    message_reset(request);
+    put_u8(request, op + 1);
+
+    if (op + 1 == REQUEST_LEAF || op + 1 == REQUEST_PROOF) {
+        put_i64(request, next_random(&connection->random_state) % leaf_count);
+    }
+    else if (op + 1 == REQUEST_RANGE) {
+
+        const int64_t first = next_random(&connection->random_state) % leaf_count;
+        int64_t count = 1 + (next_random(&connection->random_state) % 1024);
+
+        if (count > leaf_count - first) {
+            count = leaf_count - first;
+        }
+
+        put_i64(request, first);
+        put_i64(request, count);
+    }
+    else if (op + 1 == REQUEST_DIFF) {
+
+        const int level = next_random(&connection->random_state) % connection->height;
+        const int64_t level_len = ((leaf_count - 1) >> level) + 1;
+        const int64_t first_index = next_random(&connection->random_state) % level_len;
+        uint32_t count = 64;
+
+        if (count > level_len - first_index) {
+            count = level_len - first_index;
+        }
+
+        const unsigned char zeroes[DIGEST_LEN] = { 0 };
+
+        put_u8(request, level);
+        put_i64(request, first_index);
+        put_u32(request, count);
+
+        for (uint32_t i = 0; i < count; i++) {
+            put_bytes(request, zeroes, DIGEST_LEN);
+        }
+    }
+    else if (op + 1 == REQUEST_UPDATE) {
+
+        put_u32(request, connection->batch_size);
+
+        for (int i = 0; i < connection->batch_size; i++) {
+
+            char record[32];
+            const int record_len = snprintf(record, sizeof(record), "bench-%lu", (unsigned long)next_random(&connection->random_state));
+
+            put_i64(request, next_random(&connection->random_state) % leaf_count);
+            put_u32(request, record_len);
+            put_bytes(request, record, record_len);
+        }
+    }
+}
+
+void add_sample(Connection *connection, uint64_t nanoseconds, int op) {
+
+    if (connection->sample_count == connection->sample_capacity) {
+        connection->sample_capacity = connection->sample_capacity == 0 ? 4096 : connection->sample_capacity * 2;
+        connection->samples = realloc(connection->samples, sizeof(Sample) * connection->sample_capacity);
+    }
+
+    connection->samples[connection->sample_count].nanoseconds = nanoseconds;
+    connection->samples[connection->sample_count].op = op;
+    connection->sample_count++;
+}
+
+// run_connection() is the body of each connection's thread. Building the
+// request isn't timed, only sending it and waiting for the whole response.
+
+void* run_connection(void *arg) {
+
+    Connection *connection = arg;
+
+    Message request = { NULL, 0, 0, 0 };
+    Message response = { NULL, 0, 0, 0 };
+
+    const int fd = connect_to_daemon(connection->socket_path);
+    const uint64_t deadline = now_nanoseconds() + (uint64_t)(connection->seconds * 1e9);
+
+    for (long i = 0; connection->seconds > 0 || i < connection->request_limit; i++) {
+
+        if (connection->seconds > 0 && (i % 64) == 0 && now_nanoseconds() >= deadline) {
+            break;
+        }
+
+        const int op = connection->ops[next_random(&connection->random_state) % connection->op_count];
+
+        build_request(connection, op, &request);
+
+        const uint64_t start = now_nanoseconds();
+
+        if (!send_frame(fd, &request) || !receive_frame(fd, &response)) {
+            fprintf(stderr, "lost connection to the daemon\n");
+            connection->errors++;
+            break;
+        }
+
+        add_sample(connection, now_nanoseconds() - start, op);
+
+        uint8_t status;
+        uint64_t version;
+
+        if (!get_u8(&response, &status) || status != STATUS_OK || !get_u64(&response, &version)) {
+            connection->errors++;
+        }
+        else if (version > connection->last_version) {
+            connection->last_version = version;
+        }
+    }
+
+    close(fd);
+    message_free(&request);
+    message_free(&response);
+
+    return NULL;
+}
+
+// get_tree_shape() asks the daemon for its root so the connections know how
+// many records there are to pick from.
+
+void get_tree_shape(const char *socket_path, int64_t *leaf_count, int *height) {
+
+    Message request = { NULL, 0, 0, 0 };
+    Message response = { NULL, 0, 0, 0 };
+
+    uint8_t status;
+    uint64_t version;
+    uint8_t tree_height;
+
+    const int fd = connect_to_daemon(socket_path);
+
+    put_u8(&request, REQUEST_ROOT);
+
+    if (!send_frame(fd, &request) || !receive_frame(fd, &response) ||
+        !get_u8(&response, &status) || status != STATUS_OK ||
+        !get_u64(&response, &version) || !get_i64(&response, leaf_count) || !get_u8(&response, &tree_height)) {
+        fprintf(stderr, "unable to get the root from the daemon\n");
+        exit(EXIT_FAILURE);
+    }
+
+    *height = tree_height;
+
+    printf("daemon has %ld records, tree height %d, at version %lu\n", (long)*leaf_count, *height, (unsigned long)version);
+
+    close(fd);
+    message_free(&request);
+    message_free(&response);
+}
+
+int compare_latencies(const void *a, const void *b) {
+
+    const uint64_t latency_a = *(const uint64_t *)a;
+    const uint64_t latency_b = *(const uint64_t *)b;
+
+    return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+// print_latencies() sorts the latencies it's given and prints the
+// percentiles, in microseconds, along with the requests a second they add up
+// to over 'elapsed' seconds.
+
+void print_latencies(const char *name, uint64_t *latencies, long count, double elapsed) {
+
+    if (count == 0) {
+        return;
+    }
+
+    qsort(latencies, count, sizeof(uint64_t), compare_latencies);
+
+    printf("%-8s %10ld %12.0f %10.1f %10.1f %10.1f\n", name, count, count / elapsed,
+           latencies[(count - 1) * 50 / 100] / 1e3,
+           latencies[(count - 1) * 99 / 100] / 1e3,
+           latencies[count - 1] / 1e3);
+}
+
+// parse_ops() turns the -o list into the ops to pick from.
+
+int parse_ops(char *list, int *ops) {
+
+    int op_count = 0;
+
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+
+        int op = 0;
+        while (op < OP_COUNT && strcmp(name, op_names[op]) != 0) {
+            op++;
+        }
+
+        if (op == OP_COUNT) {
+            fprintf(stderr, "unknown request: %s\n", name);
+            exit(EXIT_FAILURE);
+        }
+
+        if (op_count < OP_COUNT) {
+            ops[op_count++] = op;
+        }
+    }
+
+    return op_count;
+}
+
+void print_usage(const char *executable_name) {
+    printf("Usage: %s [-c connections] [-n requests | -t seconds] [-o ops] [-b batch] -s <socket>\n", executable_name);
+}
+
+// parse_count() reads the numeric argument of an option, which must be a
+// whole number from 0 to 'max' (so it fits the field it is stored in).
+
+long parse_count(const char *arg, long max, const char *executable_name) {
+
+    char *end;
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || errno == ERANGE || value < 0 || value > max) {
+        printf("Invalid number: %s\n", arg);
+        print_usage(executable_name);
+        exit(EXIT_FAILURE);
+    }
+
+    return value;
+}
+
+// parse_seconds() is the same for -t, which can have a fractional part.
+
+double parse_seconds(const char *arg, const char *executable_name) {
+
+    char *end;
+    errno = 0;
+    double value = strtod(arg, &end);
+
+    if (*arg == '\0' || *end != '\0' || errno == ERANGE || !isfinite(value) || value < 0) {
+        printf("Invalid number: %s\n", arg);
+        print_usage(executable_name);
+        exit(EXIT_FAILURE);
+    }
+
+    return value;
+}
+
+int main(int argc, char *argv[]) {
+
+    int opt;
+    const char *socket_path = NULL;
+    int connection_count = 4;
+    long request_limit = 10000;
+    double seconds = 0;
+    int batch_size = 16;
+    char default_ops[] = "root,leaf,proof,range";
+    char *op_list = default_ops;
+
+    while ((opt = getopt(argc, argv, "s:c:n:t:o:b:")) != -1) {
+        if ((unsigned char)opt == 's') {
+            socket_path = optarg;
+        }
+        else if ((unsigned char)opt == 'c') {
+            connection_count = parse_count(optarg, INT_MAX, argv[0]);
+        }
+        else if ((unsigned char)opt == 'n') {
+            request_limit = parse_count(optarg, LONG_MAX, argv[0]);
+        }
+        else if ((unsigned char)opt == 't') {
+            seconds = parse_seconds(optarg, argv[0]);
+        }
+        else if ((unsigned char)opt == 'o') {
+            op_list = optarg;
+        }
+        else if ((unsigned char)opt == 'b') {
+            batch_size = parse_count(optarg, INT_MAX, argv[0]);
+        }
+        else {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (socket_path == NULL || connection_count < 1 || request_limit < 1 || seconds < 0 || batch_size < 1) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    int ops[OP_COUNT];
+    const int op_count = parse_ops(op_list, ops);
+
+    if (op_count == 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    int64_t leaf_count;
+    int height;
+    get_tree_shape(socket_path, &leaf_count, &height);
+
+    Connection *connections = calloc(connection_count, sizeof(Connection));
+    pthread_t *threads = malloc(sizeof(pthread_t) * connection_count);
+
+    const uint64_t start = now_nanoseconds();
+
+    for (int i = 0; i < connection_count; i++) {
+
+        connections[i].socket_path = socket_path;
+        memcpy(connections[i].ops, ops, sizeof(ops));
+        connections[i].op_count = op_count;
+        connections[i].request_limit = request_limit;
+        connections[i].seconds = seconds;
+        connections[i].batch_size = batch_size;
+        connections[i].random_state = (start ^ ((uint64_t)(i + 1) * 0x9E3779B97F4A7C15ULL)) | 1;
+        connections[i].leaf_count = leaf_count;
+        connections[i].height = height;
+
+        pthread_create(&threads[i], NULL, run_connection, &connections[i]);
+    }
+
+    for (int i = 0; i < connection_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    const double elapsed = (now_nanoseconds() - start) / 1e9;
+
+    // Gather the samples from every connection, all together and by op.
+
+    long total = 0;
+    long errors = 0;
+    uint64_t last_version = 0;
+
+    for (int i = 0; i < connection_count; i++) {
+        total += connections[i].sample_count;
+        errors += connections[i].errors;
+        if (connections[i].last_version > last_version) {
+            last_version = connections[i].last_version;
+        }
+    }
+
+    uint64_t *all_latencies = malloc(sizeof(uint64_t) * (total > 0 ? total : 1));
+    uint64_t *op_latencies = malloc(sizeof(uint64_t) * (total > 0 ? total : 1));
+
+    printf("\n%d connections, %.2f seconds, %ld errors, last version seen %lu\n\n", connection_count, elapsed, errors, (unsigned long)last_version);
+    printf("%-8s %10s %12s %10s %10s %10s\n", "request", "count", "qps", "p50 (us)", "p99 (us)", "max (us)");
+
+    for (int op = 0; op < OP_COUNT; op++) {
+
+        long op_total = 0;
+
+        for (int i = 0; i < connection_count; i++) {
+            for (long j = 0; j < connections[i].sample_count; j++) {
+                if (connections[i].samples[j].op == op) {
+                    op_latencies[op_total++] = connections[i].samples[j].nanoseconds;
+                }
+            }
+        }
+
+        print_latencies(op_names[op], op_latencies, op_total, elapsed);
+    }
+
+    long all_total = 0;
+
+    for (int i = 0; i < connection_count; i++) {
+        for (long j = 0; j < connections[i].sample_count; j++) {
+            all_latencies[all_total++] = connections[i].samples[j].nanoseconds;
+        }
+        free(connections[i].samples);
+    }
+
+    print_latencies("all", all_latencies, all_total, elapsed);
+
+    free(all_latencies);
+    free(op_latencies);
+    free(connections);
+    free(threads);
+
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
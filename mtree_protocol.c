@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Framing and packing for the protocol between mtreed and its clients. See
+// mtree_protocol.h for the layout of the messages themselves.
+
+#include "mtree_protocol.h"
+
+// message_reset() empties a Message so it can be used again without its
+// memory being freed and allocated again for every request.
+
+void message_reset(Message *message) {
+    message->len = 0;
+    message->pos = 0;
+}
+
+void message_free(Message *message) {
+    free(message->data);
+    message->data = NULL;
+    message->len = 0;
+    message->capacity = 0;
+    message->pos = 0;
+}
+
+// make_room() makes sure there's space for another 'len' bytes at the end of
+// the Message, doubling its capacity as often as it needs to.
+
+static void make_room(Message *message, size_t len) {
+
+    if (message->len + len <= message->capacity) {
+        return;
+    }
+
+    size_t capacity = message->capacity == 0 ? 256 : message->capacity;
+    while (capacity < message->len + len) {
+        capacity *= 2;
+    }
+
+    message->data = realloc(message->data, capacity);
+    message->capacity = capacity;
+}
+
+void put_bytes(Message *message, const void *bytes, size_t len) {
+    make_room(message, len);
+    memcpy(message->data + message->len, bytes, len);
+    message->len += len;
+}
+
+void put_u8(Message *message, uint8_t value) {
+    put_bytes(message, &value, sizeof(value));
+}
+
+void put_u32(Message *message, uint32_t value) {
+    put_bytes(message, &value, sizeof(value));
+}
+
+void put_u64(Message *message, uint64_t value) {
+    put_bytes(message, &value, sizeof(value));
+}
+
+void put_i64(Message *message, int64_t value) {
+    put_bytes(message, &value, sizeof(value));
+}
+
+// skip_bytes() points 'bytes' at the next 'len' bytes of the payload, without
+// copying them, and moves past them.
+
+bool skip_bytes(Message *message, const unsigned char **bytes, size_t len) {
+
+    if (len > message->len - message->pos) {
+        return false;
+    }
+
+    *bytes = message->data + message->pos;
+    message->pos += len;
+
+    return true;
+}
+
+bool get_bytes(Message *message, void *bytes, size_t len) {
+
+    const unsigned char *source;
+
+    if (!skip_bytes(message, &source, len)) {
+        return false;
+    }
+
+    memcpy(bytes, source, len);
+    return true;
+}
+
+bool get_u8(Message *message, uint8_t *value) {
+    return get_bytes(message, value, sizeof(*value));
+}
+
+bool get_u32(Message *message, uint32_t *value) {
+    return get_bytes(message, value, sizeof(*value));
+}
+
+bool get_u64(Message *message, uint64_t *value) {
+    return get_bytes(message, value, sizeof(*value));
+}
+
+bool get_i64(Message *message, int64_t *value) {
+    return get_bytes(message, value, sizeof(*value));
+}
+
+// write_all() and read_all() keep calling send() and recv() until all 'len'
+// bytes have gone, or arrived, because a socket is free to move fewer bytes
+// than it was asked to. MSG_NOSIGNAL stops a client that has gone away from
+// killing the daemon with SIGPIPE.
+
+static bool write_all(int fd, const void *bytes, size_t len) {
+
+    const unsigned char *next = bytes;
+
+    while (len > 0) {
+
+        ssize_t written = send(fd, next, len, MSG_NOSIGNAL);
+
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            return false;
+        }
+
+        next += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, void *bytes, size_t len) {
+
+    unsigned char *next = bytes;
+
+    while (len > 0) {
+
+        ssize_t received = recv(fd, next, len, 0);
+
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (received <= 0) {
+            return false;
+        }
+
+        next += received;
+        len -= received;
+    }
+
+    return true;
+}
+
+// send_frame() sends the whole of a Message as one frame. The length and the
+// payload are sent together so a small request doesn't end up as two packets.
+
+bool send_frame(int fd, Message *message) {
+
+    uint32_t len = message->len;
+    unsigned char header[sizeof(len)];
+
+    memcpy(header, &len, sizeof(len));
+
+    if (message->len + sizeof(header) <= 4096) {
+
+        unsigned char frame[4096];
+        memcpy(frame, header, sizeof(header));
+        memcpy(frame + sizeof(header), message->data, message->len);
+
+        return write_all(fd, frame, sizeof(header) + message->len);
+    }
+
+    return write_all(fd, header, sizeof(header)) && write_all(fd, message->data, message->len);
+}
+
+// receive_frame() reads the next frame into a Message, ready for the get_
+// functions. It returns false if the connection has closed or the frame is too
+// big to accept.
+
+bool receive_frame(int fd, Message *message) {
+
+    uint32_t len;
+
+    if (!read_all(fd, &len, sizeof(len)) || len > MAX_FRAME_LEN) {
+        return false;
+    }
+
+    message_reset(message);
+    make_room(message, len);
+
+    if (!read_all(fd, message->data, len)) {
+        return false;
+    }
+
+    message->len = len;
+
+    return true;
+}
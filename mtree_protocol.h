@@ -0,0 +1,111 @@
+#ifndef MTREE_PROTOCOL_H
+#define MTREE_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The protocol spoken between mtreed and its clients (mtree_bench, for
+// instance) over a Unix domain socket. Every message, in either direction, is
+// a frame: a uint32 giving the length of the payload followed by the payload
+// itself. Numbers are in the byte order of the machine, because a Unix socket
+// never leaves it, and digests are sent as raw 32-byte SHA256 digests rather
+// than 64-character hex strings.
+//
+// A request payload starts with one of the REQUEST_ codes below, followed by
+// its arguments. A response payload starts with one of the STATUS_ codes and,
+// if that's STATUS_OK, the version of the tree the answer came from, followed
+// by the answer:
+//
+//      REQUEST_ROOT    ()
+//                      -> int64 leaf_count, uint8 height, digest root
+//
+//      REQUEST_LEAF    (int64 record)
+//                      -> digest leaf
+//
+//      REQUEST_PROOF   (int64 record)
+//                      -> digest leaf, uint8 step_count,
+//                         step_count * (uint8 sibling_is_left, digest sibling)
+//
+//      REQUEST_RANGE   (int64 first, int64 count)
+//                      -> uint8 node_count,
+//                         node_count * (uint8 level, int64 index, digest)
+//
+//                      The records first to first + count - 1 are covered by
+//                      the fewest whole subtrees possible and the digest of
+//                      each subtree's root is returned, left to right.
+//
+//      REQUEST_DIFF    (uint8 level, int64 first_index, uint32 count,
+//                       count * digest)
+//                      -> uint32 diff_count, diff_count * int64 index
+//
+//                      The digests are compared with Nodes first_index to
+//                      first_index + count - 1 on 'level' and the indexes of
+//                      those that differ are returned. Walking down from the
+//                      root with this finds every changed record in another
+//                      copy of the data.
+//
+//      REQUEST_UPDATE  (uint32 count, count * (int64 record, uint32 length,
+//                       length bytes))
+//                      -> digest root
+//
+//                      Replaces the records, all at once, in a new version of
+//                      the tree. The version returned is the new one. A
+//                      record can't be empty or contain a newline, because no
+//                      data file could hold it (see next_record()).
+
+#define REQUEST_ROOT    1
+#define REQUEST_LEAF    2
+#define REQUEST_PROOF   3
+#define REQUEST_RANGE   4
+#define REQUEST_DIFF    5
+#define REQUEST_UPDATE  6
+
+// STATUS_SERVER_ERROR means the daemon couldn't answer a request it had
+// nothing wrong with, because it ran out of memory.
+
+#define STATUS_OK           0
+#define STATUS_BAD_REQUEST  1
+#define STATUS_OUT_OF_RANGE 2
+#define STATUS_SERVER_ERROR 3
+
+#define DIGEST_LEN 32
+
+// Frames bigger than this are refused, so a broken or hostile client can't
+// make either end allocate as much memory as it likes.
+
+#define MAX_FRAME_LEN (16 * 1024 * 1024)
+
+// A Message is a growable buffer used both to build a payload, with the put_
+// functions, and to pick one apart, with the get_ functions. The get_
+// functions return false rather than read past the end of the payload.
+
+struct Message {
+    unsigned char *data;
+    size_t len;
+    size_t capacity;
+    size_t pos;
+};
+
+typedef struct Message Message;
+
+void message_reset(Message *message);
+void message_free(Message *message);
+
+void put_u8(Message *message, uint8_t value);
+void put_u32(Message *message, uint32_t value);
+void put_u64(Message *message, uint64_t value);
+void put_i64(Message *message, int64_t value);
+void put_bytes(Message *message, const void *bytes, size_t len);
+
+bool get_u8(Message *message, uint8_t *value);
+bool get_u32(Message *message, uint32_t *value);
+bool get_u64(Message *message, uint64_t *value);
+bool get_i64(Message *message, int64_t *value);
+bool get_bytes(Message *message, void *bytes, size_t len);
+bool skip_bytes(Message *message, const unsigned char **bytes, size_t len);
+
+bool send_frame(int fd, Message *message);
+bool receive_frame(int fd, Message *message);
+
+#endif
@@ -0,0 +1,974 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+
+// mtreed builds a Merkle Tree from a data file once and then answers questions
+// about it (the root, a record's digest, a proof, the digests covering a range
+// of records, and which Nodes differ from another copy's) over a Unix domain
+// socket, so asking them no longer means running mtree and hashing the whole
+// file every time. Records can also be replaced while it's running. See
+// mtree_protocol.h for the protocol and mtree_bench.c for a client.
+//
+// It needs to be compiled with merkle_tree.c, mtree_protocol.c, the cakelog
+// library and the OpenSSL libraries (see the Makefile).
+
+#include "cakelog.h"
+#include "merkle_tree.h"
+#include "mtree_protocol.h"
+
+// Reading and updating the tree at the same time
+// ----------------------------------------------
+//
+// Requests are answered by a pool of worker threads. Most of them only read
+// the tree and they never take a lock to do it. Instead, the tree is never
+// changed once other threads can see it: an update builds a new version of the
+// tree and then swaps the pointer to the current version over in one atomic
+// store, in the style of RCU (read-copy-update, as used in the Linux kernel:
+// https://www.kernel.org/doc/html/latest/RCU/whatisRCU.html).
+//
+// Building a new version doesn't mean copying the whole tree. Replacing a
+// record only changes the Nodes on the path from its leaf to the root, so only
+// those are copied and everything else is shared with the previous version
+// (see apply_updates()). A batch of k updates costs at most k * height new
+// Nodes and fewer where the paths overlap.
+//
+// The Nodes the new version replaced can't be freed straight away, because a
+// reader that picked up the old version a moment ago could still be walking
+// through them. Each worker has a ReaderSlot in which it publishes the epoch
+// it started reading in, and 0 when it isn't reading at all. After the swap
+// the updater moves the epoch on and waits until every slot is either 0 or
+// from the new epoch (see wait_for_readers()). After that, no reader can still
+// be looking at the old Nodes and they're freed. It's the updater that waits
+// for readers, never the other way round, and updates are serialised with a
+// mutex so only one is ever being built at a time.
+
+struct TreeVersion {
+    uint64_t number;
+    Node *root;
+};
+
+typedef struct TreeVersion TreeVersion;
+
+// Each ReaderSlot is padded out to a cache line of its own so workers
+// publishing their epochs don't keep stealing the line from each other.
+
+struct ReaderSlot {
+    _Atomic uint64_t epoch;
+    char padding[64 - sizeof(uint64_t)];
+};
+
+typedef struct ReaderSlot ReaderSlot;
+
+#define MAX_WORKERS 256
+
+// Connections aren't tied to workers (see worker_main()), so there can be many
+// more of them than there are workers, up to MAX_CLIENTS or as many as the
+// limit on open files allows. Once a client has started sending a frame it has
+// FRAME_TIMEOUT_SECONDS to finish it, and to read its reply, so a stalled
+// client can only ever hold a worker up for that long.
+
+#define MAX_CLIENTS 4096
+#define FRAME_TIMEOUT_SECONDS 5
+
+// The shape of the tree never changes because records are only ever
+// replaced, not added or removed, so it's worked out once, when the tree is
+// built, and shared by every version.
+
+struct Server {
+    long leaf_count;
+    int height;
+    long level_lens[MAX_TREE_HEIGHT];
+
+    _Atomic(TreeVersion *) current;
+    _Atomic uint64_t epoch;
+    ReaderSlot readers[MAX_WORKERS];
+    pthread_mutex_t update_lock;
+
+    int worker_count;
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;
+    int client_limit;
+    atomic_int client_count;
+    atomic_bool stopping;
+};
+
+typedef struct Server Server;
+
+static Server server;
+
+// start_reading() publishes the current epoch in the worker's ReaderSlot and
+// then picks up the current version of the tree, which is safe to use until
+// stop_reading() is called.
+
+TreeVersion* start_reading(int worker) {
+    atomic_store(&server.readers[worker].epoch, atomic_load(&server.epoch));
+    return atomic_load(&server.current);
+}
+
+void stop_reading(int worker) {
+    atomic_store(&server.readers[worker].epoch, 0);
+}
+
+// wait_for_readers() is called after a new version has been published and
+// waits until every worker that might still be reading an older version has
+// finished with it. A worker that started reading after the epoch moved on
+// must have picked up the new version, because the version was swapped
+// before the epoch moved.
+
+void wait_for_readers(void) {
+
+    const uint64_t new_epoch = atomic_fetch_add(&server.epoch, 1) + 1;
+
+    for (int worker = 0; worker < server.worker_count; worker++) {
+
+        uint64_t epoch;
+        while ((epoch = atomic_load(&server.readers[worker].epoch)) != 0 && epoch < new_epoch) {
+            sched_yield();
+        }
+    }
+}
+
+// find_node() walks down from the root to the Node at 'level' and 'index'.
+// Each step down picks the left or right child according to the next bit of
+// 'index', from the top. The last Node on a level with an odd number of Nodes
+// has the same child on both sides, so it works there too.
+
+Node* find_node(TreeVersion *version, int level, long index) {
+
+    Node *node = version->root;
+
+    for (int current_level = server.height - 1; current_level > level; current_level--) {
+        const int bit = (index >> (current_level - 1 - level)) & 1;
+        node = bit ? node->right : node->left;
+    }
+
+    return node;
+}
+
+// put_digest() adds a Node's digest to a response as 32 raw bytes.
+
+void put_digest(Message *response, const Node *node) {
+
+    unsigned char hash[DIGEST_LEN];
+
+    digest_from_hex(node->sha256_digest, hash);
+    put_bytes(response, hash, DIGEST_LEN);
+}
+
+// Every handle_ function below is given the request with the request code
+// already read, and a response that already starts with STATUS_OK and the
+// version number. It returns STATUS_OK once it's added its answer, or another
+// status, in which case the response is thrown away and only the status is
+// sent.
+
+int handle_root(TreeVersion *version, Message *request, Message *response) {
+
+    put_i64(response, server.leaf_count);
+    put_u8(response, server.height);
+    put_digest(response, version->root);
+
+    return STATUS_OK;
+}
+
+int handle_leaf(TreeVersion *version, Message *request, Message *response) {
+
+    int64_t record;
+
+    if (!get_i64(request, &record)) {
+        return STATUS_BAD_REQUEST;
+    }
+
+    if (record < 0 || record >= server.leaf_count) {
+        return STATUS_OUT_OF_RANGE;
+    }
+
+    put_digest(response, find_node(version, 0, record));
+
+    return STATUS_OK;
+}
+
+// handle_proof() walks down to the record's leaf once, keeping the path, and
+// reads each sibling off the Node above it rather than walking down again for
+// every level. Where a Node's child has been duplicated, the sibling is the
+// same Node, just as it is in get_proof().
+
+int handle_proof(TreeVersion *version, Message *request, Message *response) {
+
+    int64_t record;
+
+    if (!get_i64(request, &record)) {
+        return STATUS_BAD_REQUEST;
+    }
+
+    if (record < 0 || record >= server.leaf_count) {
+        return STATUS_OUT_OF_RANGE;
+    }
+
+    Node *path[MAX_TREE_HEIGHT];
+    path[server.height - 1] = version->root;
+
+    for (int level = server.height - 1; level > 0; level--) {
+        const int bit = (record >> (level - 1)) & 1;
+        path[level - 1] = bit ? path[level]->right : path[level]->left;
+    }
+
+    put_digest(response, path[0]);
+    put_u8(response, server.height - 1);
+
+    for (int level = 0; level < server.height - 1; level++) {
+
+        const int bit = (record >> level) & 1;
+
+        put_u8(response, bit);
+        put_digest(response, bit ? path[level + 1]->left : path[level + 1]->right);
+    }
+
+    return STATUS_OK;
+}
+
+// handle_range() covers the records first to first + count - 1 with as few
+// whole subtrees as it can, working left to right: at each step it takes the
+// biggest subtree that starts at the next uncovered record without running
+// past the end of the range.
+
+int handle_range(TreeVersion *version, Message *request, Message *response) {
+
+    int64_t first;
+    int64_t count;
+
+    if (!get_i64(request, &first) || !get_i64(request, &count)) {
+        return STATUS_BAD_REQUEST;
+    }
+
+    if (first < 0 || count < 1 || first >= server.leaf_count || count > server.leaf_count - first) {
+        return STATUS_OUT_OF_RANGE;
+    }
+
+    const int64_t end = first + count;
+    const size_t node_count_pos = response->len;
+    uint8_t node_count = 0;
+
+    put_u8(response, 0);
+
+    for (int64_t next = first; next < end; node_count++) {
+
+        int level = 0;
+        while (level + 1 < server.height && next % (2L << level) == 0 && next + (2L << level) <= end) {
+            level++;
+        }
+
+        put_u8(response, level);
+        put_i64(response, next >> level);
+        put_digest(response, find_node(version, level, next >> level));
+
+        next += 1L << level;
+    }
+
+    response->data[node_count_pos] = node_count;
+
+    return STATUS_OK;
+}
+
+int handle_diff(TreeVersion *version, Message *request, Message *response) {
+
+    uint8_t level;
+    int64_t first_index;
+    uint32_t count;
+
+    if (!get_u8(request, &level) || !get_i64(request, &first_index) || !get_u32(request, &count)) {
+        return STATUS_BAD_REQUEST;
+    }
+
+    if (level >= server.height || first_index < 0 || first_index > server.level_lens[level] || count > server.level_lens[level] - first_index) {
+        return STATUS_OUT_OF_RANGE;
+    }
+
+    const size_t diff_count_pos = response->len;
+    uint32_t diff_count = 0;
+
+    put_u32(response, 0);
+
+    for (uint32_t i = 0; i < count; i++) {
+
+        const unsigned char *theirs;
+        unsigned char ours[DIGEST_LEN];
+
+        if (!skip_bytes(request, &theirs, DIGEST_LEN)) {
+            return STATUS_BAD_REQUEST;
+        }
+
+        digest_from_hex(find_node(version, level, first_index + i)->sha256_digest, ours);
+
+        if (memcmp(ours, theirs, DIGEST_LEN) != 0) {
+            put_i64(response, first_index + i);
+            diff_count++;
+        }
+    }
+
+    memcpy(response->data + diff_count_pos, &diff_count, sizeof(diff_count));
+
+    return STATUS_OK;
+}
+
+// An Update is one replaced record from an update request, with its new
+// record already hashed. 'sequence' is its position in the request so that,
+// once the updates are sorted, the last of several updates to the same record
+// is the one that sticks.
+
+struct Update {
+    long record;
+    long sequence;
+    char digest[65];
+};
+
+typedef struct Update Update;
+
+int compare_updates(const void *a, const void *b) {
+
+    const Update *update_a = a;
+    const Update *update_b = b;
+
+    if (update_a->record != update_b->record) {
+        return (update_a->record > update_b->record) - (update_a->record < update_b->record);
+    }
+
+    return (update_a->sequence > update_b->sequence) - (update_a->sequence < update_b->sequence);
+}
+
+// The Nodes replaced by an update are collected in a RetiredNodes list so
+// they can be freed once no reader can reach them any more.
+
+struct RetiredNodes {
+    Node **nodes;
+    long count;
+    long capacity;
+};
+
+typedef struct RetiredNodes RetiredNodes;
+
+void retire_node(RetiredNodes *retired, Node *node) {
+
+    if (retired->count == retired->capacity) {
+        retired->capacity = retired->capacity == 0 ? 64 : retired->capacity * 2;
+        retired->nodes = realloc(retired->nodes, sizeof(Node*) * retired->capacity);
+    }
+
+    retired->nodes[retired->count++] = node;
+}
+
+// apply_updates() returns a copy of the subtree under 'node' (the Node at
+// 'level' and 'index') with 'updates', which must be sorted by record and all
+// lie underneath it, applied. Subtrees with no updates in them are shared
+// rather than copied, and each Node that is copied is copied once however many
+// updates lie underneath it, with its digest worked out from its new children.
+// The Nodes that have been replaced are added to 'retired'.
+
+Node* apply_updates(Node *node, int level, long index, Update *updates, long update_count, RetiredNodes *retired) {
+
+    if (update_count == 0) {
+        return node;
+    }
+
+    retire_node(retired, node);
+
+    if (level == 0) {
+        return new_node(NULL, NULL, strdup(updates[update_count - 1].digest));
+    }
+
+    // The updates are split between the two children at the first record
+    // underneath the right child.
+
+    const long right_first_record = ((index * 2) + 1) << (level - 1);
+
+    long split = 0;
+    while (split < update_count && updates[split].record < right_first_record) {
+        split++;
+    }
+
+    Node *left = apply_updates(node->left, level - 1, index * 2, updates, split, retired);
+    Node *right;
+
+    // A Node whose left child was duplicated has nothing real on its right,
+    // so there can't be any updates there.
+
+    if (node->right == node->left) {
+        right = left;
+    }
+    else {
+        right = apply_updates(node->right, level - 1, (index * 2) + 1, updates + split, update_count - split, retired);
+    }
+
+    char digest[129];
+    char hex_digest[65];
+
+    memcpy(digest, left->sha256_digest, 64);
+    memcpy(digest + 64, right->sha256_digest, 64);
+    sha256_hex(digest, 128, hex_digest);
+
+    return new_node(left, right, strdup(hex_digest));
+}
+
+// handle_update() hashes the new records before taking the update lock, so
+// several updates can be hashing at once, then builds and publishes the new
+// version, waits for readers of the old one to finish, and frees what the new
+// version replaced. The reply isn't sent until then, so a client that gets a
+// reply knows every later request, from anyone, will see its update.
+
+int handle_update(Message *request, Message *response) {
+
+    uint32_t update_count;
+
+    if (!get_u32(request, &update_count) || update_count == 0) {
+        return STATUS_BAD_REQUEST;
+    }
+
+    // Every update takes at least 13 bytes of the request (a record number,
+    // a length and a record of at least one byte), so the count is checked
+    // against what's left of it before anything is allocated.
+
+    if (update_count > (request->len - request->pos) / (sizeof(int64_t) + sizeof(uint32_t) + 1)) {
+        return STATUS_BAD_REQUEST;
+    }
+
+    Update *updates = malloc(sizeof(Update) * update_count);
+
+    if (updates == NULL) {
+        return STATUS_SERVER_ERROR;
+    }
+
+    for (uint32_t i = 0; i < update_count; i++) {
+
+        int64_t record;
+        uint32_t record_len;
+        const unsigned char *record_data;
+
+        if (!get_i64(request, &record) || !get_u32(request, &record_len) || !skip_bytes(request, &record_data, record_len)) {
+            free(updates);
+            return STATUS_BAD_REQUEST;
+        }
+
+        // next_record() never reads an empty record or one with a newline
+        // in it out of a data file, so accepting one would give the tree a
+        // root that mtree could never reproduce from any file.
+
+        if (record_len == 0 || memchr(record_data, '\n', record_len) != NULL) {
+            free(updates);
+            return STATUS_BAD_REQUEST;
+        }
+
+        if (record < 0 || record >= server.leaf_count) {
+            free(updates);
+            return STATUS_OUT_OF_RANGE;
+        }
+
+        updates[i].record = record;
+        updates[i].sequence = i;
+        sha256_hex((const char *)record_data, record_len, updates[i].digest);
+    }
+
+    qsort(updates, update_count, sizeof(Update), compare_updates);
+
+    pthread_mutex_lock(&server.update_lock);
+
+    TreeVersion *old_version = atomic_load(&server.current);
+    RetiredNodes retired = { NULL, 0, 0 };
+
+    TreeVersion *new_version = malloc(sizeof(TreeVersion));
+    new_version->number = old_version->number + 1;
+    new_version->root = apply_updates(old_version->root, server.height - 1, 0, updates, update_count, &retired);
+
+    atomic_store(&server.current, new_version);
+
+    wait_for_readers();
+
+    for (long i = 0; i < retired.count; i++) {
+        free(retired.nodes[i]->sha256_digest);
+        free(retired.nodes[i]);
+    }
+
+    free(retired.nodes);
+    free(old_version);
+
+    // The reply is built before the lock is let go because, once it is,
+    // another update could replace the new version and free it: this worker
+    // isn't in its ReaderSlot, so nothing would wait for it.
+
+    message_reset(response);
+    put_u8(response, STATUS_OK);
+    put_u64(response, new_version->number);
+    put_digest(response, new_version->root);
+
+    pthread_mutex_unlock(&server.update_lock);
+
+    cakelog("applied %u updates", update_count);
+
+    free(updates);
+
+    return STATUS_OK;
+}
+
+// handle_request() answers one request. Everything apart from an update is
+// answered from whichever version of the tree is current when it starts.
+
+void handle_request(int worker, Message *request, Message *response) {
+
+    uint8_t request_code;
+    int status;
+
+    message_reset(response);
+
+    if (!get_u8(request, &request_code)) {
+        put_u8(response, STATUS_BAD_REQUEST);
+        return;
+    }
+
+    if (request_code == REQUEST_UPDATE) {
+        status = handle_update(request, response);
+    }
+    else {
+
+        TreeVersion *version = start_reading(worker);
+
+        put_u8(response, STATUS_OK);
+        put_u64(response, version->number);
+
+        if (request_code == REQUEST_ROOT) {
+            status = handle_root(version, request, response);
+        }
+        else if (request_code == REQUEST_LEAF) {
+            status = handle_leaf(version, request, response);
+        }
+        else if (request_code == REQUEST_PROOF) {
+            status = handle_proof(version, request, response);
+        }
+        else if (request_code == REQUEST_RANGE) {
+            status = handle_range(version, request, response);
+        }
+        else if (request_code == REQUEST_DIFF) {
+            status = handle_diff(version, request, response);
+        }
+        else {
+            status = STATUS_BAD_REQUEST;
+        }
+
+        stop_reading(worker);
+    }
+
+    if (status != STATUS_OK) {
+        message_reset(response);
+        put_u8(response, status);
+    }
+}
+
+// watch_fd() asks the epoll instance to hand 'fd' to a worker the next time
+// it's readable. EPOLLONESHOT means it's handed to exactly one worker and
+// then ignored until it's watched again, so two workers never read from the
+// same connection at once.
+
+bool watch_fd(int fd, int operation) {
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.fd = fd;
+
+    return epoll_ctl(server.epoll_fd, operation, fd, &event) == 0;
+}
+
+void close_client(int client_fd) {
+    close(client_fd);
+    atomic_fetch_sub(&server.client_count, 1);
+}
+
+// accept_clients() accepts every connection waiting on the (non-blocking)
+// listening socket. A connection over the 'client_limit' is closed straight
+// away rather than left waiting for a place that may never come up.
+
+void accept_clients(void) {
+
+    const struct timeval frame_timeout = { FRAME_TIMEOUT_SECONDS, 0 };
+
+    while (true) {
+
+        const int client_fd = accept4(server.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        if (atomic_fetch_add(&server.client_count, 1) >= server.client_limit) {
+            cakelog("refusing connection: already serving %d clients", server.client_limit);
+            close_client(client_fd);
+            continue;
+        }
+
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &frame_timeout, sizeof(frame_timeout));
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &frame_timeout, sizeof(frame_timeout));
+
+        if (!watch_fd(client_fd, EPOLL_CTL_ADD)) {
+            close_client(client_fd);
+        }
+    }
+
+    watch_fd(server.listen_fd, EPOLL_CTL_MOD);
+}
+
+// Every worker waits on the same epoll instance, which holds the listening
+// socket and every open connection. Whichever worker picks up a readable
+// connection answers the one request waiting on it and then hands the
+// connection back to be watched again, so a connection only takes up a
+// worker while there's a request on it and clients that are connected but
+// quiet don't keep anyone else waiting. A client that hangs up, or doesn't
+// finish its frame in time, is closed.
+//
+// The daemon is stopped by writing to 'wake_fd', which is watched without
+// EPOLLONESHOT and never read, so it wakes every worker.
+
+void* worker_main(void *arg) {
+
+    const int worker = (int)(intptr_t)arg;
+
+    Message request = { NULL, 0, 0, 0 };
+    Message response = { NULL, 0, 0, 0 };
+
+    while (!atomic_load(&server.stopping)) {
+
+        struct epoll_event event;
+        const int ready = epoll_wait(server.epoll_fd, &event, 1, -1);
+
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (ready == -1) {
+            break;
+        }
+
+        const int fd = event.data.fd;
+
+        if (fd == server.wake_fd) {
+            continue;
+        }
+
+        if (fd == server.listen_fd) {
+            accept_clients();
+            continue;
+        }
+
+        if (!receive_frame(fd, &request)) {
+            close_client(fd);
+            continue;
+        }
+
+        handle_request(worker, &request, &response);
+
+        if (!send_frame(fd, &response) || !watch_fd(fd, EPOLL_CTL_MOD)) {
+            close_client(fd);
+        }
+    }
+
+    message_free(&request);
+    message_free(&response);
+
+    return NULL;
+}
+
+// open_socket() creates the Unix domain socket the daemon listens on. A socket
+// left behind by a daemon that didn't shut down cleanly is removed first, but
+// anything else already at that path is left alone.
+
+int open_socket(const char *socket_path) {
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "socket path is too long: %s\n", socket_path);
+        exit(EXIT_FAILURE);
+    }
+
+    strcpy(address.sun_path, socket_path);
+
+    struct stat socket_stats;
+    if (lstat(socket_path, &socket_stats) == 0 && S_ISSOCK(socket_stats.st_mode)) {
+        unlink(socket_path);
+    }
+
+    const int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("socket()");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        perror("bind()");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(listen_fd, SOMAXCONN) == -1) {
+        perror("listen()");
+        exit(EXIT_FAILURE);
+    }
+
+    return listen_fd;
+}
+
+// free_nodes() frees every Node in a version of the tree when the daemon stops.
+// The duplicated child of the last Node on a level is only freed once.
+
+void free_nodes(Node *node) {
+
+    if (node->left != NULL) {
+        free_nodes(node->left);
+        if (node->right != node->left) {
+            free_nodes(node->right);
+        }
+    }
+
+    free(node->sha256_digest);
+    free(node);
+}
+
+// Usage (assuming the executable is called 'mtreed') is:
+//
+//      mtreed [-d|-f] [-t threads] -s <socket> <datafile>
+//
+// Where <datafile> is the name of an input file that contains a list of words
+// on each line, as it is for mtree, and <socket> is the path of the Unix
+// domain socket to listen on. -t sets the number of worker threads (by default,
+// twice the number of CPUs, at least 16 and at most MAX_WORKERS). Workers
+// aren't tied to connections, so this is the number of requests that can be
+// answered at once rather than the number of clients that can be connected
+// (see worker_main()). -d and -f turn on the cakelog debug log, just as they
+// do for mtree.
+//
+// Every level of the tree is kept in memory (the retention options of mtree
+// aren't available) because updates are applied by copying Nodes and so need
+// every Node to be there. The daemon runs until it gets SIGINT or SIGTERM.
+
+void print_usage(const char *executable_name) {
+    printf("Usage: %s [-d|-f] [-t threads] -s <socket> <datafile>\n", executable_name);
+}
+
+// parse_count() reads the numeric argument of an option, which must be a
+// whole number from 0 to 'max' (so it fits the field it is stored in).
+
+long parse_count(const char *arg, long max, const char *executable_name) {
+
+    char *end;
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || errno == ERANGE || value < 0 || value > max) {
+        printf("Invalid number: %s\n", arg);
+        print_usage(executable_name);
+        exit(EXIT_FAILURE);
+    }
+
+    return value;
+}
+
+int main(int argc, char *argv[]) {
+
+    int opt;
+    const char *socket_path = NULL;
+    long worker_count = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+
+    if (worker_count < 16) {
+        worker_count = 16;
+    }
+
+    if (worker_count > MAX_WORKERS) {
+        worker_count = MAX_WORKERS;
+    }
+
+    while ((opt = getopt(argc, argv, "dfs:t:")) != -1) {
+        if ((unsigned char)opt == 'd') {
+            /* debug without flush */
+            cakelog_initialise(argv[0], false);
+        }
+        else if ((unsigned char)opt == 'f') {
+            /* debug with flush */
+            cakelog_initialise(argv[0], true);
+        }
+        else if ((unsigned char)opt == 's') {
+            socket_path = optarg;
+        }
+        else if ((unsigned char)opt == 't') {
+            worker_count = parse_count(optarg, MAX_WORKERS, argv[0]);
+        }
+        else {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc || socket_path == NULL) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (worker_count < 1) {
+        fprintf(stderr, "threads must be between 1 and %d\n", MAX_WORKERS);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("reading file %s\n", argv[optind]);
+
+    print_progress = true;
+
+    RetentionPolicy keep_everything = { 0, 0 };
+    MerkleTree *tree = build_tree_from_file(argv[optind], keep_everything, 1);
+
+    if (tree == NULL) {
+        fprintf(stderr, "unable to build tree from %s: %s\n", argv[optind], errno == ENODATA ? "no words found" : strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    print_progress = false;
+
+    // From here on the tree is reached through its root and the Nodes belong
+    // to the versions, which free them as they're replaced. The layers are
+    // let go of so free_tree() only unmaps the data file, which isn't needed
+    // any more either.
+
+    server.leaf_count = tree->leaf_count;
+    server.height = tree->height;
+    memcpy(server.level_lens, tree->level_lens, sizeof(server.level_lens));
+
+    TreeVersion *first_version = malloc(sizeof(TreeVersion));
+    first_version->number = 1;
+    first_version->root = tree->levels[tree->height - 1][0];
+
+    for (int level = 0; level < tree->height; level++) {
+        free(tree->levels[level]);
+        tree->levels[level] = NULL;
+    }
+
+    free_tree(tree);
+
+    atomic_init(&server.current, first_version);
+    atomic_init(&server.epoch, 1);
+    atomic_init(&server.stopping, false);
+    pthread_mutex_init(&server.update_lock, NULL);
+    server.worker_count = worker_count;
+
+    for (int worker = 0; worker < MAX_WORKERS; worker++) {
+        atomic_init(&server.readers[worker].epoch, 0);
+    }
+
+    // Some files have to be left over for the tree's own use, the log and
+    // the sockets the daemon opens itself.
+
+    struct rlimit file_limit;
+    server.client_limit = MAX_CLIENTS;
+
+    if (getrlimit(RLIMIT_NOFILE, &file_limit) == 0 && file_limit.rlim_cur != RLIM_INFINITY && file_limit.rlim_cur < MAX_CLIENTS + 64) {
+        server.client_limit = file_limit.rlim_cur > 128 ? file_limit.rlim_cur - 64 : 64;
+    }
+
+    atomic_init(&server.client_count, 0);
+
+    server.listen_fd = open_socket(socket_path);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.wake_fd = eventfd(0, EFD_CLOEXEC);
+
+    struct epoll_event wake_event;
+    wake_event.events = EPOLLIN;
+    wake_event.data.fd = server.wake_fd;
+
+    if (server.epoll_fd == -1 || server.wake_fd == -1
+        || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.wake_fd, &wake_event) == -1
+        || !watch_fd(server.listen_fd, EPOLL_CTL_ADD)) {
+        perror("epoll");
+        exit(EXIT_FAILURE);
+    }
+
+    // The first version can be replaced, and freed, as soon as the workers
+    // start, so its root is printed now.
+
+    printf("\n");
+    printf("================================================================================\n");
+    printf("Root digest is: %s\n", first_version->root->sha256_digest);
+    printf("================================================================================\n");
+    printf("\n");
+
+    // SIGINT and SIGTERM are blocked before the workers start, so they
+    // inherit the mask and the signals are only ever picked up by sigwait(),
+    // below, rather than interrupting a worker part way through a request.
+
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    pthread_t *workers = malloc(sizeof(pthread_t) * worker_count);
+
+    for (int worker = 0; worker < worker_count; worker++) {
+        pthread_create(&workers[worker], NULL, worker_main, (void *)(intptr_t)worker);
+    }
+
+    printf("serving %ld records on %s with %ld threads\n", server.leaf_count, socket_path, worker_count);
+    fflush(stdout);
+
+    int signal_number;
+    sigwait(&stop_signals, &signal_number);
+
+    printf("stopping on signal %d\n", signal_number);
+
+    // Writing to 'wake_fd' wakes up every worker waiting for a request. Any
+    // connections still open are closed when the process exits.
+
+    atomic_store(&server.stopping, true);
+
+    const uint64_t wake = 1;
+    if (write(server.wake_fd, &wake, sizeof(wake)) != sizeof(wake)) {
+        perror("write()");
+    }
+
+    for (int worker = 0; worker < worker_count; worker++) {
+        pthread_join(workers[worker], NULL);
+    }
+
+    free(workers);
+    close(server.epoll_fd);
+    close(server.wake_fd);
+    close(server.listen_fd);
+    unlink(socket_path);
+
+    TreeVersion *last_version = atomic_load(&server.current);
+    printf("final version is %lu, root digest %s\n", (unsigned long)last_version->number, last_version->root->sha256_digest);
+
+    free_nodes(last_version->root);
+    free(last_version);
+
+    pthread_mutex_destroy(&server.update_lock);
+
+    cakelog_stop();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+# Builds the 'cmerkle' CPython extension module (see merkle_tree_module.c) on
+# top of the same C sources as mtree. OpenSSL needs to be installed, exactly as
+# it does for mtree.
+#
+#       python3 setup.py build_ext --inplace
+
+from setuptools import setup, Extension
+
+cmerkle = Extension('cmerkle',
+                    sources=['merkle_tree_module.c',
+                             'merkle_tree.c',
+                             'cakelog/cakelog.c'],
+                    include_dirs=['cakelog'],
+                    libraries=['ssl', 'crypto', 'm'])
+
+setup(name='cmerkle',
+      version='0.1',
+      description='Merkle Trees built by the C engine behind mtree',
+      ext_modules=[cmerkle])
@@ -0,0 +1,109 @@
+import hashlib
+
+import cmerkle
+import merkle_tree
+
+# Checks that the cmerkle extension module (see merkle_tree_module.c) gives
+# the same answers as the reference implementation in merkle_tree.py: the same
+# root for odd and even numbers of records, a single record included, under
+# every retention policy, and proofs and diffs that agree with the reference
+# tree's leaves. Build the module first and then run it from the repo
+# directory:
+#
+#       make python
+#       python3 test_cmerkle.py
+
+RECORD_COUNTS = list(range(1, 70)) + [127, 128, 129, 1023, 1024, 1025, 4095, 4096, 4097, 300001]
+
+POLICIES = [(0, 0), (1, 0), (2, 0), (5, 0), (0, 2), (0, 3), (3, 4)]
+
+
+def make_records(count, changed=()):
+
+    # The records vary in length so a record found at the wrong offset can't
+    # hash to the right digest by accident.
+
+    return [('record-{0}-{1}'.format(i, 'x' * (i % 7)) + ('-changed' if i in changed else '')).encode('utf-8')
+            for i in range(count)]
+
+
+def reference_leaves(records):
+    return [merkle_tree.Node(hashed_data=hashlib.sha256(record)) for record in records]
+
+
+def reference_root(records):
+    return merkle_tree.build_tree(reference_leaves(records)).hashed_data.hexdigest()
+
+
+def reference_runs(records, other_records):
+
+    # The runs of neighbouring records that differ, as Tree.diff() reports
+    # them.
+
+    runs = []
+
+    for i, (record, other_record) in enumerate(zip(records, other_records)):
+        if record != other_record:
+            if runs and runs[-1][1] == i - 1:
+                runs[-1] = (runs[-1][0], i)
+            else:
+                runs.append((i, i))
+
+    return runs
+
+
+def sample_records(count):
+
+    # Every record for small trees, otherwise both ends, the middle and
+    # either side of a few subtree boundaries.
+
+    if count <= 70:
+        return range(count)
+
+    picks = {0, 1, count // 2, count - 2, count - 1}
+    for boundary in (1024, 65536, 131072):
+        picks.update(r for r in (boundary - 1, boundary) if r < count)
+
+    return sorted(picks)
+
+
+def check(count):
+
+    records = make_records(count)
+    data = b'\n'.join(records) + b'\n'
+    expected_root = reference_root(records)
+
+    assert cmerkle.root(data) == expected_root, 'root of {0} records'.format(count)
+
+    changed = {0, count // 3, (count // 3) + 1, count - 1}
+    other_records = make_records(count, changed)
+    other_data = b'\n'.join(other_records)
+    expected_other_root = reference_root(other_records)
+    expected_runs = reference_runs(records, other_records)
+
+    for top_levels, level_stride in POLICIES:
+
+        policy = 'top_levels={0}, level_stride={1}'.format(top_levels, level_stride)
+        tree = cmerkle.Tree(data, top_levels=top_levels, level_stride=level_stride)
+
+        assert tree.root == expected_root, 'root of {0} records with {1}'.format(count, policy)
+        assert len(tree) == count
+
+        for record in sample_records(count):
+
+            leaf = tree.digest(0, record)
+            assert leaf == hashlib.sha256(records[record]).hexdigest(), 'leaf {0} of {1} with {2}'.format(record, count, policy)
+            assert cmerkle.fold_proof(leaf, tree.proof(record)) == expected_root, 'proof {0} of {1} with {2}'.format(record, count, policy)
+
+        other_tree = cmerkle.Tree(other_data, top_levels=top_levels, level_stride=level_stride)
+
+        assert other_tree.root == expected_other_root
+        assert tree.diff(other_tree) == expected_runs, 'diff of {0} records with {1}'.format(count, policy)
+
+
+if __name__ == '__main__':
+
+    for count in RECORD_COUNTS:
+        check(count)
+
+    print('cmerkle matches merkle_tree.py for {0} record counts and {1} retention policies'.format(len(RECORD_COUNTS), len(POLICIES)))